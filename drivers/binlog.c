@@ -0,0 +1,111 @@
+/*
+    binlog.c - deferred binary logging
+
+    A log call costs one timestamp read, a small copy and a slot claim on the
+    multi-producer ring; all formatting happens on the host. See binlog.h for
+    the record layout.
+
+    The timestamp source defaults to the DWT cycle counter. Host builds can
+    name their own uint32_t (void) function with -DBINLOG_TIMESTAMP=name.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "binlog.h"
+#include "circbuff.h"
+#include "uart.h"
+
+#ifdef BINLOG_TIMESTAMP
+uint32_t BINLOG_TIMESTAMP(void);
+#else
+#include "kinetis.h"
+#define BINLOG_TIMESTAMP() (ARM_DWT_CYCCNT)
+#define BINLOG_USE_DWT
+#endif
+
+_Static_assert(CB_IS_POW2(BINLOG_BUF_SIZE),
+               "BINLOG_BUF_SIZE must be a power of 2");
+
+static uint8_t binlog_storage[BINLOG_BUF_SIZE];
+static CircularBufferMP binlog_ring;
+static uint32_t binlog_uart;
+static volatile uint32_t binlog_lost;
+
+
+void binlog_init(uint32_t uart)
+{
+#ifdef BINLOG_USE_DWT
+    // Start the cycle counter.
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+
+    cb_mp_init(&binlog_ring, binlog_storage, BINLOG_BUF_SIZE);
+    binlog_uart = uart;
+    binlog_lost = 0;
+    return;
+}
+
+
+void binlog_write(uint32_t hdr, const uint32_t* args)
+{
+    uint32_t rec[2 + BINLOG_MAX_ARGS];
+    uint32_t nargs = (hdr >> BINLOG_NARGS_SHIFT) & 0xF;
+
+    rec[0] = hdr;
+    rec[1] = BINLOG_TIMESTAMP();
+    for (uint32_t i = 0; i < nargs; i++){
+        rec[2 + i] = args[i];
+    }
+
+    if (cb_mp_write(&binlog_ring, (const uint8_t*) rec, 4 * (2 + nargs))){
+        // Ring full, record lost. Other producers may be counting too, so
+        // the increment must be atomic (LDREX/STREX on the M4).
+        __atomic_fetch_add(&binlog_lost, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+uint32_t binlog_flush(void)
+{
+    CircularBuffer* cb = &binlog_ring.cb;
+    uint32_t total = 0;
+    uint8_t* p;
+
+    // At most two spans: up to the end of storage, then from the start.
+    for (int i = 0; i < 2; i++){
+        uint32_t n = cb_peek_contiguous(cb, &p);
+        if (!n){
+            break;
+        }
+        uint32_t sent = uart_write(binlog_uart, p, n);
+        cb_commit_read(cb, sent);
+        total += sent;
+        if (sent < n){
+            // UART TX buffer full, try again next time.
+            break;
+        }
+    }
+    return total;
+}
+
+
+uint32_t binlog_dropped(void)
+{
+    return binlog_lost;
+}
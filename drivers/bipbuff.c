@@ -0,0 +1,120 @@
+/*
+    bipbuff.c - bipartite circular buffer
+
+    Byte queue that hands out contiguous regions of arbitrary length, so a
+    record is never split across the end of storage.
+
+    The layout follows the lock-free bip buffer scheme (as in bbqueue):
+    write and read chase each other like a normal ring, except that when the
+    writer wraps early it records where its data ended in last, and the
+    reader jumps back to 0 on reaching last. Each index has a single writer:
+    the producer owns write, last and grant; the consumer owns read.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bipbuff.h"
+#include "circbuff.h"
+
+// Initialize bb as empty.
+void bb_init(BipBuffer* bb, uint8_t* buf, uint32_t size)
+{
+    bb->write = 0;
+    bb->read = 0;
+    bb->last = 0;
+    bb->grant = 0;
+    bb->size = size;
+    bb->buf = buf;
+    return;
+}
+
+
+// Find len contiguous free bytes. write == read always means empty, so the
+// writer may never catch up to read from behind.
+uint8_t* bb_reserve(BipBuffer* bb, uint32_t len)
+{
+    uint32_t write = bb->write;
+    uint32_t read = bb->read;
+    uint32_t start;
+
+    // Also keeps write + len below from wrapping.
+    if (len == 0 || len > bb->size){
+        return 0;
+    }
+
+    if (write < read){
+        // Already wrapped: free space is between write and read.
+        if (write + len >= read){
+            return 0;
+        }
+        start = write;
+    } else if (write + len <= bb->size){
+        start = write;
+    } else if (len < read){
+        // No room at the end, but there is at the start.
+        start = 0;
+    } else {
+        return 0;
+    }
+
+    bb->grant = start;
+    return &bb->buf[start];
+}
+
+
+void bb_commit(BipBuffer* bb, uint32_t used)
+{
+    uint32_t write = bb->write;
+    uint32_t new_write = bb->grant + used;
+
+    if (new_write < write && write != bb->size){
+        // Wrapped early; data at the end of storage stops at write.
+        bb->last = write;
+    } else if (new_write > bb->last){
+        // Passed the previous wrap point, so the whole end is valid again.
+        bb->last = bb->size;
+    }
+
+    CB_BARRIER();
+    bb->write = new_write;
+}
+
+
+uint32_t bb_peek(BipBuffer* bb, uint8_t** ptr)
+{
+    uint32_t write = bb->write;
+    uint32_t last = bb->last;
+    uint32_t read = bb->read;
+    CB_BARRIER();
+
+    if (read == last && write < read){
+        // Finished the end section; follow the writer back to the start.
+        read = 0;
+        bb->read = 0;
+    }
+
+    *ptr = &bb->buf[read];
+    return ((write < read) ? last : write) - read;
+}
+
+
+void bb_release(BipBuffer* bb, uint32_t used)
+{
+    CB_BARRIER();
+    bb->read += used;
+}
@@ -4,6 +4,17 @@
     Provides simple byte queue of arbitrary length. User supplies the storage
     for the buffer, which must be sized as a power of 2.
 
+    head and tail are free-running counters that are only masked when the
+    storage is accessed. head - tail is the fill level, so every slot is
+    usable and full/empty need no special cases. Safe for one producer and
+    one consumer (e.g. ISR and main loop) without locking. Each side caches
+    the other's index, so the shared volatile is only re-read when the
+    cached view runs out of data or space.
+
+    CircularBufferMP adds lock-free multi-producer writes on top, using
+    LDREX/STREX on target and GCC's C11-model __atomic builtins on a host
+    build, so the same logic can be exercised with threads.
+
 
     This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
     Copyright 2017 Patrick Schubert
@@ -22,15 +33,48 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
 #include "circbuff.h"
 
+// Free space as seen by the producer. The shared tail is only re-read when
+// the cached copy shows less than want bytes free.
+static inline uint32_t cb_prod_space(CircularBuffer* cb, uint32_t head,
+                                     uint32_t want)
+{
+    uint32_t space = (cb->mask + 1) - (head - cb->tail_cache);
+    if (space < want){
+        cb->tail_cache = cb->tail;
+        space = (cb->mask + 1) - (head - cb->tail_cache);
+    }
+    return space;
+}
+
+// Bytes available as seen by the consumer. The shared head is only re-read
+// when the cached copy shows fewer than want bytes waiting.
+static inline uint32_t cb_cons_avail(CircularBuffer* cb, uint32_t tail,
+                                     uint32_t want)
+{
+    uint32_t avail = cb->head_cache - tail;
+    if (avail < want){
+        cb->head_cache = cb->head;
+        avail = cb->head_cache - tail;
+    }
+    return avail;
+}
+
 // Initialize buf as empty.
 void cb_init(CircularBuffer* cb, uint8_t* buf, uint32_t size)
 {
     cb->head = 0;
     cb->tail = 0;
+    cb->tail_cache = 0;
+    cb->head_cache = 0;
+    cb->dropped = 0;
     cb->mask = size - 1;
     cb->buf = buf;
+#ifdef CB_STATS
+    memset(&cb->stats, 0, sizeof(cb->stats));
+#endif
     return;
 }
 
@@ -38,13 +82,15 @@ void cb_init(CircularBuffer* cb, uint8_t* buf, uint32_t size)
 // Return -1 if full, 0 on success.
 int cb_putc(CircularBuffer* cb, uint8_t c)
 {
-    uint32_t next_head = (cb->head + 1) & cb->mask;
-    if (next_head == cb->tail){
+    uint32_t head = cb->head;
+    if (cb_prod_space(cb, head, 1) == 0){
         // buff full!
+        CB_STAT_FULL(cb);
         return -1;
     }
-    cb->buf[cb->head] = c;
-    cb->head = next_head;
+    cb->buf[head & cb->mask] = c;
+    cb->head = head + 1;
+    CB_STAT_FILL(cb, 1);
     return 0;
 }
 
@@ -52,41 +98,370 @@ int cb_putc(CircularBuffer* cb, uint8_t c)
 // Return 0 if empty.
 uint8_t cb_getc(CircularBuffer* cb)
 {
-    if (cb->head == cb->tail){
+    uint32_t tail = cb->tail;
+    if (cb_cons_avail(cb, tail, 1) == 0){
         // No data
+        CB_STAT_EMPTY(cb);
         return 0;
     }
 
-    uint32_t next_tail = (cb->tail + 1) & cb->mask;
-    uint8_t c = cb->buf[cb->tail];
-    cb->tail = next_tail;
+    uint8_t c = cb->buf[tail & cb->mask];
+    cb->tail = tail + 1;
     return c;
 }
 
-// Return true if buf is full.
+// Return true if buf is full. Producer side only.
 int cb_isfull(CircularBuffer* cb)
 {
-    // if head + 1 == tail, then full
-    uint32_t next = (cb->head + 1) & cb->mask;
-    return next == cb->tail;
+    return cb_prod_space(cb, cb->head, 1) == 0;
 }
 
-// Return true if buf is empty.
+// Return true if buf is empty. Consumer side only.
 int cb_isempty(CircularBuffer* cb)
 {
-    // if head == tail, then no data
-    return cb->head == cb->tail;
+    return cb_cons_avail(cb, cb->tail, 1) == 0;
+}
+
+// Return number of bytes waiting to be read.
+uint32_t cb_count(CircularBuffer* cb)
+{
+    return cb->head - cb->tail;
 }
 
 // Return amount of empty space.
 uint32_t cb_space(CircularBuffer* cb)
+{
+    return (cb->mask + 1) - (cb->head - cb->tail);
+}
+
+
+// Copy up to len bytes from src into the buffer. Data goes in as at most two
+// memcpys (up to the end of storage, then from the start), and head is only
+// published once everything is in place.
+// Returns number of bytes written.
+uint32_t cb_write(CircularBuffer* cb, const uint8_t* src, uint32_t len)
+{
+    uint32_t head = cb->head;
+    uint32_t space = cb_prod_space(cb, head, len);
+    if (len > space){
+        CB_STAT_FULL(cb);
+        len = space;
+    }
+
+    cb_store(cb, head, src, len);
+
+    CB_BARRIER();
+    cb->head = head + len;
+    CB_STAT_FILL(cb, len);
+    return len;
+}
+
+
+// Copy up to len bytes out of the buffer into dst, advancing tail once.
+// Returns number of bytes read.
+uint32_t cb_read(CircularBuffer* cb, uint8_t* dst, uint32_t len)
 {
     uint32_t tail = cb->tail;
+    uint32_t avail = cb_cons_avail(cb, tail, len);
+    if (avail == 0){
+        CB_STAT_EMPTY(cb);
+    }
+    if (len > avail){
+        len = avail;
+    }
+    CB_BARRIER();
+
+    cb_load(cb, tail, dst, len);
+
+    CB_BARRIER();
+    cb->tail = tail + len;
+    return len;
+}
+
+
+// Point *ptr at the oldest unread byte and return how many bytes can be read
+// from there without wrapping. Nothing is consumed until cb_commit_read.
+uint32_t cb_peek_contiguous(CircularBuffer* cb, uint8_t** ptr)
+{
+    uint32_t tail = cb->tail;
+    uint32_t off = tail & cb->mask;
+    uint32_t to_end = (cb->mask + 1) - off;
+    uint32_t avail = cb_cons_avail(cb, tail, to_end);
+    if (avail == 0){
+        CB_STAT_EMPTY(cb);
+    }
+    CB_BARRIER();
+
+    *ptr = (uint8_t*) &cb->buf[off];
+    return (avail < to_end) ? avail : to_end;
+}
+
+
+// Release n bytes previously returned by cb_peek_contiguous.
+void cb_commit_read(CircularBuffer* cb, uint32_t n)
+{
+    CB_BARRIER();
+    cb->tail += n;
+}
+
+
+// Point *ptr at the next free byte and return how many bytes can be written
+// from there without wrapping. Nothing is published until cb_commit_write.
+uint32_t cb_reserve_contiguous(CircularBuffer* cb, uint8_t** ptr)
+{
     uint32_t head = cb->head;
-    if (head >= tail){
-        return (cb->mask + 1) - head + tail;
-    } else {
-        return (cb->mask + 1) - tail + head;
+    uint32_t off = head & cb->mask;
+    uint32_t to_end = (cb->mask + 1) - off;
+    uint32_t space = cb_prod_space(cb, head, to_end);
+
+    *ptr = (uint8_t*) &cb->buf[off];
+    return (space < to_end) ? space : to_end;
+}
+
+
+// Publish n bytes written into the span from cb_reserve_contiguous.
+void cb_commit_write(CircularBuffer* cb, uint32_t n)
+{
+    CB_BARRIER();
+    cb->head += n;
+    CB_STAT_FILL(cb, n);
+}
+
+
+// Copy len bytes into storage starting at free-running index pos. The caller
+// has already made sure the space is free and publishes it afterwards.
+void cb_store(CircularBuffer* cb, uint32_t pos, const uint8_t* src,
+              uint32_t len)
+{
+    uint32_t off = pos & cb->mask;
+    uint32_t first = (cb->mask + 1) - off;
+    if (first > len){
+        first = len;
     }
+    memcpy((uint8_t*) &cb->buf[off], src, first);
+    memcpy((uint8_t*) &cb->buf[0], src + first, len - first);
 }
 
+
+// Copy len bytes out of storage starting at free-running index pos, without
+// consuming them.
+void cb_load(CircularBuffer* cb, uint32_t pos, uint8_t* dst, uint32_t len)
+{
+    uint32_t off = pos & cb->mask;
+    uint32_t first = (cb->mask + 1) - off;
+    if (first > len){
+        first = len;
+    }
+    memcpy(dst, (uint8_t*) &cb->buf[off], first);
+    memcpy(dst + first, (uint8_t*) &cb->buf[0], len - first);
+}
+
+
+#if defined(__arm__)
+// If *p still holds old, replace it with new and return 1, else return 0.
+// Any exception taken between LDREX and STREX clears the exclusive monitor,
+// so a preempted update fails its STREX and is retried.
+static int cb_cas(volatile uint32_t* p, uint32_t old, uint32_t new)
+{
+    uint32_t cur, fail;
+    do {
+        __asm__ volatile ("ldrex %0, [%1]" : "=r" (cur) : "r" (p) : "memory");
+        if (cur != old){
+            __asm__ volatile ("clrex" ::: "memory");
+            return 0;
+        }
+        __asm__ volatile ("strex %0, %2, [%1]"
+                          : "=&r" (fail) : "r" (p), "r" (new) : "memory");
+    } while (fail);
+    return 1;
+}
+#else
+static int cb_cas(volatile uint32_t* p, uint32_t old, uint32_t new)
+{
+    return __atomic_compare_exchange_n(p, &old, new, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+
+// Initialize mp as empty.
+void cb_mp_init(CircularBufferMP* mp, uint8_t* buf, uint32_t size)
+{
+    cb_init(&mp->cb, buf, size);
+    mp->reserve = 0;
+    mp->written = 0;
+}
+
+
+int cb_mp_putc(CircularBufferMP* mp, uint8_t c)
+{
+    return cb_mp_write(mp, &c, 1);
+}
+
+
+/*  Multi-producer write.
+
+    1. Claim [pos, pos+len) by advancing reserve, if it fits.
+    2. Copy the data in. Other producers may be filling their own claims.
+    3. Add len to written. If written then equals reserve, every claimed
+       byte is in place and head can move up to it. If not, some earlier or
+       later claim is still being filled, and whoever finishes last will
+       publish for everyone.
+
+    A producer interrupted mid-copy holds back head until it resumes, but
+    never blocks the ISR that interrupted it.
+*/
+int cb_mp_write(CircularBufferMP* mp, const uint8_t* src, uint32_t len)
+{
+    CircularBuffer* cb = &mp->cb;
+    uint32_t pos;
+    do {
+        pos = mp->reserve;
+        if ((cb->mask + 1) - (pos - cb->tail) < len){
+            // buff full!
+            return -1;
+        }
+    } while (!cb_cas(&mp->reserve, pos, pos + len));
+
+    cb_store(cb, pos, src, len);
+    CB_BARRIER();
+
+    uint32_t done;
+    do {
+        done = mp->written;
+    } while (!cb_cas(&mp->written, done, done + len));
+    done += len;
+
+    if (done == mp->reserve){
+        // Publish, unless a later producer already moved head past us.
+        uint32_t head;
+        do {
+            head = cb->head;
+            if ((int32_t)(done - head) <= 0){
+                break;
+            }
+        } while (!cb_cas(&cb->head, head, done));
+    }
+    return 0;
+}
+
+
+void cb_putc_overwrite(CircularBuffer* cb, uint8_t c)
+{
+    cb_write_overwrite(cb, &c, 1);
+}
+
+
+/*  Overwrite-mode write.
+
+    Here the producer may move tail too, so both sides update it with
+    compare-and-swap. The producer always frees the space before storing
+    into it, which is what lets cb_read_overwrite notice a lost race.
+*/
+void cb_write_overwrite(CircularBuffer* cb, const uint8_t* src, uint32_t len)
+{
+    uint32_t size = cb->mask + 1;
+    if (len > size){
+        // Only the newest size bytes can survive anyway.
+        cb->dropped += len - size;
+        CB_STAT_FULL_N(cb, len - size);
+        src += len - size;
+        len = size;
+    }
+
+    uint32_t head = cb->head;
+    uint32_t tail, over;
+    do {
+        tail = cb->tail;
+        over = (head - tail) + len;
+        if (over <= size){
+            over = 0;
+            break;
+        }
+        over -= size;
+    } while (!cb_cas(&cb->tail, tail, tail + over));
+    cb->dropped += over;
+    CB_STAT_FULL_N(cb, over);
+
+    cb_store(cb, head, src, len);
+
+    CB_BARRIER();
+    cb->head = head + len;
+    // Fill only grew by what wasn't pushed out, so a full ring isn't seen
+    // as crossing the threshold again.
+    CB_STAT_FILL(cb, len - over);
+}
+
+
+// Consumer side of an overwrite-mode ring. Copies out up to len bytes, then
+// claims them by moving tail with compare-and-swap. If the producer moved
+// tail in the meantime, part of the copy may be stale, so start over.
+// The producer can also run between the tail and head loads, making
+// head - tail look larger than the ring; never copy more than size bytes.
+uint32_t cb_read_overwrite(CircularBuffer* cb, uint8_t* dst, uint32_t len)
+{
+    uint32_t size = cb->mask + 1;
+    uint32_t tail, n;
+    do {
+        tail = cb->tail;
+        n = cb->head - tail;
+        if (n > size){
+            n = size;
+        }
+        if (n > len){
+            n = len;
+        }
+        CB_BARRIER();
+        cb_load(cb, tail, dst, n);
+        CB_BARRIER();
+    } while (!cb_cas(&cb->tail, tail, tail + n));
+    return n;
+}
+
+
+uint32_t cb_dropped(CircularBuffer* cb)
+{
+    return cb->dropped;
+}
+
+
+#ifdef CB_STATS
+void cb_stat_fill(CircularBuffer* cb, uint32_t n)
+{
+    CbStats* st = &cb->stats;
+    uint32_t fill = cb->head - cb->tail;
+    uint32_t bin = (fill * CB_STATS_BINS) / (cb->mask + 1);
+
+    if (bin >= CB_STATS_BINS){
+        bin = CB_STATS_BINS - 1;
+    }
+    st->hist[bin]++;
+
+    if (fill > st->peak){
+        st->peak = fill;
+    }
+    if (st->threshold && fill >= st->threshold && fill - n < st->threshold
+        && st->on_threshold){
+        st->on_threshold(cb, fill);
+    }
+}
+
+
+void cb_stats_reset(CircularBuffer* cb)
+{
+    CbStats* st = &cb->stats;
+    st->peak = 0;
+    memset(st->hist, 0, sizeof(st->hist));
+    st->full_hits = 0;
+    st->empty_hits = 0;
+}
+
+
+void cb_set_threshold(CircularBuffer* cb, uint32_t level,
+                      void (*fn)(CircularBuffer* cb, uint32_t fill))
+{
+    cb->stats.on_threshold = 0;
+    cb->stats.threshold = level;
+    cb->stats.on_threshold = fn;
+}
+#endif
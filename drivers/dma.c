@@ -65,6 +65,19 @@ void dma_set_mux(uint32_t ch, uint32_t source)
 }
 
 
+// Disconnect a channel from its DMA mux source.
+void dma_clear_mux(uint32_t ch)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return;
+    }
+
+    DMAMUX_CHCFG(ch) = DMAMUX_DISABLE;
+    return;
+}
+
+
 // Apply DMA TCD to a dma channel.
 void dma_configure(uint32_t ch, DMA_TCD* tcd)
 {
@@ -124,6 +137,33 @@ void dma_enable_int(uint32_t ch)
 }
 
 
+// Set NVIC priority of the DMA channel interrupt.
+void dma_set_int_priority(uint32_t ch, uint8_t priority)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return;
+    }
+
+    NVIC_SET_PRIORITY(ch, priority);
+    return;
+}
+
+
+// Enable half-major-loop interrupt on DMA channel.
+void dma_enable_halfint(uint32_t ch)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return;
+    }
+
+    DMA_TCD_CSR(ch) |= DMA_TCD_CSR_INTHALF;
+    NVIC_ENABLE_IRQ(ch);
+    return;
+}
+
+
 // Disable interrupt on DMA channel.
 void dma_disable_int(uint32_t ch)
 {
@@ -137,3 +177,67 @@ void dma_disable_int(uint32_t ch)
     return;
 }
 
+
+// Clear interrupt request on DMA channel.
+void dma_clear_int(uint32_t ch)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return;
+    }
+
+    DMA_CINT = DMA_CINT_CINT(ch);
+    return;
+}
+
+
+// Set channel to drop its request enable at end of major loop.
+void dma_set_oneshot(uint32_t ch)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return;
+    }
+
+    DMA_TCD_CSR(ch) |= DMA_TCD_CSR_DREQ;
+    return;
+}
+
+
+// Reload source address and major loop count on an idle channel.
+void dma_set_source(uint32_t ch, volatile void* source, uint16_t citer)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return;
+    }
+
+    DMA_TCD_SADDR(ch) = source;
+    DMA_TCD_BITER(ch) = (0x7fff & citer);
+    DMA_TCD_CITER(ch) = (0x7fff & citer);
+    return;
+}
+
+
+// Get remaining major loop count on DMA channel.
+uint16_t dma_remaining(uint32_t ch)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return 0;
+    }
+
+    return DMA_TCD_CITER(ch) & 0x7fff;
+}
+
+
+// Get current destination address of DMA channel.
+volatile void* dma_dest(uint32_t ch)
+{
+    if (DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return 0;
+    }
+
+    return DMA_TCD_DADDR(ch);
+}
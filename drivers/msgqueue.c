@@ -0,0 +1,88 @@
+/*
+    msgqueue.c - queue of whole messages on circular buffer storage
+
+    Messages are framed with a 16-bit length in a CircularBuffer. The
+    producer copies header and payload in with cb_store and only then
+    publishes them, first by moving head (which the consumer does not use)
+    and then by bumping pushed. The consumer treats pushed != popped as
+    "message ready", so it can never see half a message, and pushed - popped
+    is the message count.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "msgqueue.h"
+
+// Initialize mq as empty.
+void mq_init(MsgQueue* mq, uint8_t* buf, uint32_t size)
+{
+    cb_init(&mq->cb, buf, size);
+    mq->pushed = 0;
+    mq->popped = 0;
+    return;
+}
+
+
+int mq_push(MsgQueue* mq, const void* msg, uint16_t len)
+{
+    CircularBuffer* cb = &mq->cb;
+    uint32_t head = cb->head;
+
+    if (cb_space(cb) < MQ_HDR_SIZE + (uint32_t) len){
+        // queue full!
+        return -1;
+    }
+
+    cb_store(cb, head, (const uint8_t*) &len, MQ_HDR_SIZE);
+    cb_store(cb, head + MQ_HDR_SIZE, (const uint8_t*) msg, len);
+
+    CB_BARRIER();
+    cb->head = head + MQ_HDR_SIZE + len;
+    mq->pushed++;
+    return 0;
+}
+
+
+int mq_pop(MsgQueue* mq, void* msg, uint16_t maxlen)
+{
+    CircularBuffer* cb = &mq->cb;
+    uint32_t tail = cb->tail;
+    uint16_t len;
+
+    if (mq->pushed == mq->popped){
+        // No messages
+        return -1;
+    }
+    CB_BARRIER();
+
+    cb_load(cb, tail, (uint8_t*) &len, MQ_HDR_SIZE);
+    cb_load(cb, tail + MQ_HDR_SIZE, (uint8_t*) msg,
+            (len < maxlen) ? len : maxlen);
+
+    CB_BARRIER();
+    cb->tail = tail + MQ_HDR_SIZE + len;
+    mq->popped++;
+    return len;
+}
+
+
+// Return number of queued messages.
+uint32_t mq_count(MsgQueue* mq)
+{
+    return mq->pushed - mq->popped;
+}
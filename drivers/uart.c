@@ -1,14 +1,15 @@
 /*
-    uart.c - support for uart0 peripheral on mk20/teensy
+    uart.c - support for uart0-2 peripherals on mk20/teensy
 
-    Interface to UART0 on teensy3, using teensy pins 0 and 1. ISR driven, with
-    ring buffer backing TX and RX.
+    Interface to UART0, UART1 and UART2 on teensy3. ISR driven, with ring
+    buffers backing TX and RX on each instance. All three share one driver;
+    per-instance registers, pins, clock and buffers live in a UartState.
+    TX and RX can optionally be handed to DMA channels with
+    uart_tx_dma_enable and uart_rx_dma_enable.
 
     Some sections written with help from Teensyduino/PJRC serial1.c code, as
     noted.
 
-    TODO: Support multiple uart channels
-
 
     This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
     Copyright 2017 Patrick Schubert
@@ -27,217 +28,1761 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
+#include <stdarg.h>
 #include "kinetis.h"
 #include "uart.h"
 #include "circbuff.h"
+#include "dma.h"
+#include "systick.h"
+#include "gpio.h"
 
-// Size of RX and TX ring buffers
+// Size of RX and TX ring buffers, per instance. RX storage is aligned to its
+// size so DMA RX can wrap it with DMOD.
 #define TX_BUF_SIZE (64)
 #define RX_BUF_SIZE (64)
 
-#define FIFO_DEPTH (8)
+// Index masks, one per ring size. The sizes are free to differ, so always
+// mask a ring with its own.
+#define TX_BUF_MASK (TX_BUF_SIZE - 1)
+#define RX_BUF_MASK (RX_BUF_SIZE - 1)
+
+// Bytes between RX DMA interrupts, and so between RX ring fill checks in
+// DMA mode. See uart_set_flowctrl for how it bounds the RTS slack.
+#define RX_DMA_STEP (RX_BUF_SIZE / 8)
+
+// NVIC priority of every interrupt that touches an instance's state: status,
+// error and DMA channel. All at one level, so none can preempt another
+// halfway through a ring or FIFO update.
+#define UART_IRQ_PRIORITY (64)
+
+CB_DEFINE_ALIGNED(uart0_rx, RX_BUF_SIZE);
+CB_DEFINE(uart0_tx, TX_BUF_SIZE);
+CB_DEFINE_ALIGNED(uart1_rx, RX_BUF_SIZE);
+CB_DEFINE(uart1_tx, TX_BUF_SIZE);
+CB_DEFINE_ALIGNED(uart2_rx, RX_BUF_SIZE);
+CB_DEFINE(uart2_tx, TX_BUF_SIZE);
+
+// RX arrival stamps: DWT cycle count when the ISR saw a chunk of bytes, and
+// the free-running RX head just past that chunk.
+typedef struct {
+    uint32_t ts;
+    uint32_t end;
+} UartRxStamp;
+CB_TYPED_DECLARE(UartStampRing, uart_stamp, UartRxStamp)
+
+#define RX_STAMPS (RX_BUF_SIZE / 2)
+CB_TYPED_DEFINE(uart0_stamps, UartStampRing, UartRxStamp, RX_STAMPS);
+CB_TYPED_DEFINE(uart1_stamps, UartStampRing, UartRxStamp, RX_STAMPS);
+CB_TYPED_DEFINE(uart2_stamps, UartStampRing, UartRxStamp, RX_STAMPS);
+
+// Statistics hooks, no-ops unless built with UART_STATS.
+#ifdef UART_STATS
+#define UART_STAT_ADD(u, field, n) ((u)->stats.field += (n))
+#define UART_STAT_MAX(u, field, v) do { \
+    if ((v) > (u)->stats.field) (u)->stats.field = (v); \
+} while (0)
+#else
+#define UART_STAT_ADD(u, field, n) ((void) 0)
+#define UART_STAT_MAX(u, field, v) ((void) 0)
+#endif
+
+// Per-instance driver state.
+typedef struct {
+    KINETISK_UART_t* regs;
+    CircularBuffer* rx_buf;
+    CircularBuffer* tx_buf;
+    UartStampRing* stamps;      // RX arrival times, see uart_read_frame
+    uint32_t stamp_end;         // RX head at the last stamp
+    volatile uint32_t* rx_pcr;  // pin control for RX/TX pins
+    volatile uint32_t* tx_pcr;
+    uint32_t clock;             // module clock, for baud math
+    uint32_t scgc4;             // clock gate bit in SIM_SCGC4
+    uint32_t irq;               // status interrupt number
+    uint32_t err_irq;           // error interrupt number
+    uint8_t dmamux_tx;          // DMA mux request sources
+    uint8_t dmamux_rx;
+    uint8_t fifo_depth;         // TX FIFO depth, read from PFIFO at init
+    uint8_t frame_bits;         // bits per character on the wire
+    volatile uint8_t errors;    // Bitfield of things that break. Read with
+                                // uart_geterror.
+    volatile uint8_t err_held;  // S1 errors whose interrupt is off until
+                                // the RX path reads D
+    int8_t tx_dma;              // TX DMA channel, or -1 for ISR driven TX
+    volatile uint16_t tx_span;  // bytes in flight on TX DMA, 0 when idle
+    int8_t rx_dma;              // RX DMA channel, or -1 for ISR driven RX
+    volatile uint8_t rx_lost;   // RX DMA lapped the reader, see
+                                // uart_rx_dma_resync
+    uint32_t rts_pin;           // RTS pin (TEENSY_PIN_x), 0 if none
+    volatile uint32_t* rts_pcr; // its pin control if it's a hardware RTS pin
+    volatile uint8_t rts_off;   // RTS deasserted, sender told to hold off
+#ifdef UART_STATS
+    UartStats stats;
+#endif
+} UartState;
+
+static UartState uarts[UART_NUM_INSTANCES] = {
+    {
+        .regs = &KINETISK_UART0, .rx_buf = &uart0_rx, .tx_buf = &uart0_tx,
+        .stamps = &uart0_stamps,
+        .rx_pcr = &PORTB_PCR16, .tx_pcr = &PORTB_PCR17,
+        .clock = F_CPU, .scgc4 = SIM_SCGC4_UART0, .irq = IRQ_UART0_STATUS,
+        .err_irq = IRQ_UART0_ERROR,
+        .dmamux_tx = DMAMUX_SOURCE_UART0_TX,
+        .dmamux_rx = DMAMUX_SOURCE_UART0_RX, .tx_dma = -1, .rx_dma = -1,
+    },
+    {
+        .regs = &KINETISK_UART1, .rx_buf = &uart1_rx, .tx_buf = &uart1_tx,
+        .stamps = &uart1_stamps,
+        .rx_pcr = &PORTC_PCR3, .tx_pcr = &PORTC_PCR4,
+        .clock = F_CPU, .scgc4 = SIM_SCGC4_UART1, .irq = IRQ_UART1_STATUS,
+        .err_irq = IRQ_UART1_ERROR,
+        .dmamux_tx = DMAMUX_SOURCE_UART1_TX,
+        .dmamux_rx = DMAMUX_SOURCE_UART1_RX, .tx_dma = -1, .rx_dma = -1,
+    },
+    {
+        .regs = &KINETISK_UART2, .rx_buf = &uart2_rx, .tx_buf = &uart2_tx,
+        .stamps = &uart2_stamps,
+        .rx_pcr = &PORTD_PCR2, .tx_pcr = &PORTD_PCR3,
+        .clock = F_BUS, .scgc4 = SIM_SCGC4_UART2, .irq = IRQ_UART2_STATUS,
+        .err_irq = IRQ_UART2_ERROR,
+        .dmamux_tx = DMAMUX_SOURCE_UART2_TX,
+        .dmamux_rx = DMAMUX_SOURCE_UART2_RX, .tx_dma = -1, .rx_dma = -1,
+    },
+};
+
+
+// Flow control pins the UART can drive or sense itself, all on ALT3.
+typedef struct {
+    uint32_t uart;
+    uint32_t pin;
+    volatile uint32_t* pcr;
+} UartPin;
+
+static const UartPin uart_cts_pins[] = {
+    { UART0, TEENSY_PIN_18, &PORTB_PCR3 },
+    { UART0, TEENSY_PIN_20, &PORTD_PCR5 },
+    { UART1, TEENSY_PIN_23, &PORTC_PCR2 },
+    { UART2, TEENSY_PIN_14, &PORTD_PCR1 },
+};
+
+static const UartPin uart_rts_pins[] = {
+    { UART0, TEENSY_PIN_6,  &PORTD_PCR4 },
+    { UART0, TEENSY_PIN_19, &PORTB_PCR2 },
+    { UART1, TEENSY_PIN_22, &PORTC_PCR1 },
+    { UART2, TEENSY_PIN_2,  &PORTD_PCR0 },
+};
+
+// Pin control register for pin on uart from table, or 0 if it isn't there.
+static volatile uint32_t* uart_find_pin(const UartPin* table, uint32_t n,
+                                        uint32_t uart, uint32_t pin)
+{
+    for (uint32_t i = 0; i < n; i++){
+        if (table[i].uart == uart && table[i].pin == pin){
+            return table[i].pcr;
+        }
+    }
+    return 0;
+}
+
+// RX buffer fill levels at which RTS is deasserted and asserted again. The
+// gap above RTS_HIGH covers bytes the sender has already committed to.
+#define RTS_HIGH (RX_BUF_SIZE * 3 / 4)
+#define RTS_LOW  (RX_BUF_SIZE / 4)
+_Static_assert(RTS_HIGH + RX_DMA_STEP < RX_BUF_SIZE,
+               "RX DMA can fill the ring before RTS_HIGH is seen");
+
+// Producer side: tell the sender to stop once the RX buffer passes RTS_HIGH.
+// A hardware RTS pin is taken back from the UART as a GPIO, which is left
+// driving high.
+static inline void uart_rts_fill(UartState* u, uint32_t fill)
+{
+    if (u->rts_pin && !u->rts_off && fill >= RTS_HIGH){
+        u->rts_off = 1;
+        if (u->rts_pcr){
+            *u->rts_pcr = PORT_PCR_MUX(0x1);
+        } else {
+            gpio_set(u->rts_pin);
+        }
+    }
+}
+
+// Consumer side: let the sender go again once drained to RTS_LOW, handing a
+// hardware RTS pin back to the UART. Masked so the ISR can't deassert in
+// between the check and the pin write.
+static inline void uart_rts_drain(UartState* u)
+{
+    if (u->rts_off){
+        __disable_irq();
+        if (u->rts_off && cb_count(u->rx_buf) <= RTS_LOW){
+            u->rts_off = 0;
+            if (u->rts_pcr){
+                *u->rts_pcr = PORT_PCR_MUX(0x3);
+            } else {
+                gpio_clr(u->rts_pin);
+            }
+        }
+        __enable_irq();
+    }
+}
+
+// Stop driving RTS from the ring. The pin is left as a GPIO driving low
+// (go), so a sender that was being throttled isn't held off for good.
+static void uart_rts_release(UartState* u)
+{
+    __disable_irq();
+    uint32_t pin = u->rts_pin;
+    volatile uint32_t* pcr = u->rts_pcr;
+    u->rts_pin = 0;
+    u->rts_pcr = 0;
+    u->rts_off = 0;
+    __enable_irq();
+    if (pin){
+        gpio_clr(pin);
+        if (pcr){
+            *pcr = PORT_PCR_MUX(0x1);
+        }
+    }
+}
 
-CircularBuffer rx_buf;
-CircularBuffer tx_buf;
 
-uint8_t rxb[RX_BUF_SIZE];
-uint8_t txb[TX_BUF_SIZE];
+// Re-enable the error interrupts held off by uart_rx_error. Called after
+// the RX path has read D.
+static inline void uart_rx_error_release(UartState* u)
+{
+    if (u->err_held){
+        u->err_held = 0;
+        u->regs->C3 |= UART_C3_ORIE | UART_C3_NEIE | UART_C3_FEIE
+                     | UART_C3_PEIE;
+    }
+}
+
+
+// Stop a channel a UART was using: no more requests, no more interrupts,
+// nothing pending, and no longer routed to the UART's DMA request.
+static void uart_dma_stop(int32_t ch)
+{
+    if (ch < 0){
+        return;
+    }
+    dma_disable(ch);
+    dma_disable_int(ch);
+    dma_clear_int(ch);
+    dma_clear_mux(ch);
+}
+
+
+// Start a DMA span from the head of the TX ring if none is in flight. Runs
+// from thread and DMA isr context, so the check-and-start is atomic.
+static void uart_tx_dma_start(UartState* u)
+{
+    uint8_t* p;
+
+    __disable_irq();
+    if (!u->tx_span){
+        uint32_t len = cb_peek_contiguous(u->tx_buf, &p);
+        if (len){
+            u->tx_span = len;
+            dma_set_source(u->tx_dma, p, len);
+            dma_enable(u->tx_dma);
+            u->regs->C2 |= UART_C2_TIE;
+        }
+    }
+    __enable_irq();
+}
+
+
+// Get the transmitter going after data is added to the TX ring.
+static inline void uart_tx_kick(UartState* u)
+{
+    if (0 <= u->tx_dma){
+        uart_tx_dma_start(u);
+    } else {
+        u->regs->C2 |= UART_C2_TIE;
+    }
+}
+
+
+// Stamp whatever arrived since the last stamp with ts. Called from the ISRs
+// after new RX bytes are published. If the stamp ring is full the stamp is
+// dropped, and those bytes go out with the next chunk's timestamp.
+static inline void uart_rx_stamp(UartState* u, uint32_t ts)
+{
+    uint32_t end = u->rx_buf->head;
+    if (end != u->stamp_end){
+        UartRxStamp s = { .ts = ts, .end = end };
+        if (!uart_stamp_put(u->stamps, s)){
+            u->stamp_end = end;
+        }
+    }
+}
+
+
+// Ring index the RX DMA channel will write next.
+static inline uint32_t uart_rx_dma_pos(UartState* u)
+{
+    uintptr_t dest = (uintptr_t) dma_dest(u->rx_dma);
+    return (dest - (uintptr_t) u->rx_buf->buf) & RX_BUF_MASK;
+}
+
+
+/*  Publish bytes DMA has landed in the RX ring since the last call, and
+    stamp them with ts. The write position comes from the channel's
+    destination address.
+
+    Called from both the status ISR (idle line) and the channel's DMA ISR.
+    head moves by a delta worked out from its old value, so the read-modify-
+    write and the stamp run with interrupts masked; otherwise one caller
+    preempting the other would add the same bytes to head twice.
+
+    DMA does not honour tail. If more arrived than there was room for, the
+    DMA has written over bytes the reader hasn't taken yet. head has to stay
+    in step with the DMA address, but it can't move past tail, and only the
+    reader may move tail. So publishing stops and rx_lost is set, and the
+    reader's next call drops the whole ring and starts again at the DMA
+    position (uart_rx_dma_resync). Nothing is delivered twice.
+
+    The DMA position is only known modulo RX_BUF_SIZE. If a whole ring's
+    worth lands between two updates, n comes out short by RX_BUF_SIZE and
+    that much data is lost without any error flag. The DMA interrupt every
+    RX_DMA_STEP bytes keeps updates far closer together than that.
+*/
+static void uart_rx_dma_update(UartState* u, uint32_t ts)
+{
+    CircularBuffer* rx = u->rx_buf;
+
+    __disable_irq();
+    uint32_t n = (uart_rx_dma_pos(u) - rx->head) & RX_BUF_MASK;
+
+    if (n && !u->rx_lost){
+        if (n > cb_space(rx)){
+            u->errors |= UART_ERROR_RXOVER;
+            u->rx_lost = 1;
+        } else {
+            cb_commit_write(rx, n);
+            UART_STAT_ADD(u, rx_bytes, n);
+            UART_STAT_MAX(u, rx_buf_peak, cb_count(rx));
+            uart_rts_fill(u, cb_count(rx));
+        }
+    }
+    uart_rx_stamp(u, ts);
+    uart_rx_error_release(u);
+    __enable_irq();
+}
+
+
+/*  Reader side of an RX DMA overrun, see uart_rx_dma_update. Throws away
+    everything in the ring, which the DMA has partly overwritten, and moves
+    both indices to the DMA position. Dropped bytes are counted as the
+    unread ring plus what landed since; laps the DMA made while the reader
+    was away can't be seen and are not counted. Called at the start of every
+    RX read, so the ISRs never see the indices half moved.
+*/
+static void uart_rx_dma_resync(UartState* u)
+{
+    if (!u->rx_lost){
+        return;
+    }
+    CircularBuffer* rx = u->rx_buf;
+
+    __disable_irq();
+    uint32_t head = rx->head;
+    uint32_t next = head + ((uart_rx_dma_pos(u) - head) & RX_BUF_MASK);
+    UART_STAT_ADD(u, rx_dropped, next - rx->tail);
+    rx->head = next;
+    rx->head_cache = next;
+    rx->tail = next;
+    rx->tail_cache = next;
+    u->stamp_end = next;
+    u->rx_lost = 0;
+    __enable_irq();
+    uart_rts_drain(u);
+}
+
+
+/*  Baud rate generator
+    baud = clock / (16 * (SBR + BRFA/32)), with SBR 13 bits (1..8191) and
+    BRFA the 5 bit fine adjust. Working in 1/32 steps, the divisor is
+    32 * SBR + BRFA = 2 * clock / baud (math from Teensyduino's BAUD2DIV),
+    rounded to nearest. UART0/1 run from the core clock, UART2 from the bus
+    clock, so the fastest rate is clock / 16 and UART2 tops out lower.
+*/
+#define UART_DIV_MIN (32)               // SBR 1, BRFA 0
+#define UART_DIV_MAX ((8191 << 5) | 31) // SBR 8191, BRFA 31/32
+
+// Write a computed divisor. BDL last, which is what latches the new SBR.
+static void uart_load_baud(KINETISK_UART_t* regs, const UartBaud* b)
+{
+    regs->C4 = (regs->C4 & ~0x1F) | (b->brfa & 0x1F);
+    regs->BDH = (regs->BDH & ~0x1F) | ((b->sbr >> 8) & 0x1F);
+    regs->BDL = b->sbr & 0xFF;
+}
 
-// Bitfield to keep track of things that break. Read with uart_geterror.
-static volatile uint8_t uart_errors = 0;
 
 /* Initialize UART
  *
  * 4.7us
  */
-void uart_init(uint32_t baud)
+void uart_init(uint32_t uart, uint32_t baud)
 {
-    cb_init(&rx_buf, rxb, RX_BUF_SIZE);
-    cb_init(&tx_buf, txb, TX_BUF_SIZE);
+    if (UART_NUM_INSTANCES <= uart){
+        // out of range
+        return;
+    }
+    UartState* u = &uarts[uart];
+    KINETISK_UART_t* regs = u->regs;
+
+    // Stop DMA left running by an earlier uart_init and uart_*_dma_enable,
+    // before its rings are reset underneath it. Channel interrupts go off
+    // too, since the DMA isrs do nothing once the channel is forgotten.
+    uart_dma_stop(u->tx_dma);
+    uart_dma_stop(u->rx_dma);
 
-    uart_errors = 0;
+    u->errors = 0;
+    u->tx_dma = -1;
+    u->tx_span = 0;
+    u->rx_dma = -1;
+    u->rx_lost = 0;
+    uart_rts_release(u);
+    uart_reset_stats(uart);
+
+    // Start the cycle counter for RX timestamps.
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
 
     // enable clock
-    SIM_SCGC4 |= SIM_SCGC4_UART0;
+    SIM_SCGC4 |= u->scgc4;
 
     // enable pins as UART, with pullups.
-    PORTB_PCR16 = PORT_PCR_MUX(0x3) | PORT_PCR_PE | PORT_PCR_PS;
-    PORTB_PCR17 = PORT_PCR_MUX(0x3) | PORT_PCR_PE | PORT_PCR_PS;
+    *u->rx_pcr = PORT_PCR_MUX(0x3) | PORT_PCR_PE | PORT_PCR_PS;
+    *u->tx_pcr = PORT_PCR_MUX(0x3) | PORT_PCR_PE | PORT_PCR_PS;
 
     // disable uart while settings change.
-    UART0_C2 = 0;
+    regs->C2 = 0;
+
+    // Empty the rings, so a second uart_init (new baud or framing) doesn't
+    // hand out stale data or keep stale cached indices. Masked in case a
+    // status interrupt was already pending.
+    __disable_irq();
+    cb_init(u->rx_buf, (uint8_t*) u->rx_buf->buf, RX_BUF_SIZE);
+    cb_init(u->tx_buf, (uint8_t*) u->tx_buf->buf, TX_BUF_SIZE);
+    uart_stamp_init(u->stamps, u->stamps->buf, RX_STAMPS);
+    u->stamp_end = 0;
+    __enable_irq();
 
     // clear settings
-    UART0_C1 = 0;
-    UART0_C3 = 0;
-    UART0_C4 = 0;
-    UART0_C5 = 0;
+    regs->C1 = 0;
+    regs->C3 = 0;
+    regs->C4 = 0;
+    regs->C5 = 0;
+    regs->MODEM = 0;
 
     // Clear any preexisting data
-    UART0_CFIFO |= UART_CFIFO_TXFLUSH | UART_CFIFO_RXFLUSH;
+    regs->CFIFO |= UART_CFIFO_TXFLUSH | UART_CFIFO_RXFLUSH;
+
+    // FIFO size field: 0 = 1 byte (no FIFO), n = 2^(n+1) bytes.
+    uint8_t size = (regs->PFIFO >> 4) & 0x7;
+    u->fifo_depth = size ? (2 << size) : 1;
 
     // Enabled FIFOs
-    UART0_PFIFO |= UART_PFIFO_TXFE | UART_PFIFO_RXFE;
-    UART0_TWFIFO = 2;
-    UART0_RWFIFO = 4;
+    regs->PFIFO |= UART_PFIFO_TXFE | UART_PFIFO_RXFE;
+    if (1 < u->fifo_depth){
+        regs->TWFIFO = 2;
+        regs->RWFIFO = 4;
+    } else {
+        regs->TWFIFO = 0;
+        regs->RWFIFO = 1;
+    }
 
-    // Baud generator math from Teensyduino
-    #define BAUD2DIV(baud) (((F_CPU * 2) + ((baud) >> 1)) / (baud))
-    uint32_t div = BAUD2DIV(baud);
-    UART0_BDH = (div >> 13) & 0x1F;
-    UART0_BDL = (div >> 5) & 0xFF;
-    UART0_C4 = div & 0x1F;
+    // 8N1 until uart_setparity says otherwise.
+    u->frame_bits = 10;
 
-    UART0_C1 |= UART_C1_ILT; // Idle count starts after STOP bit.
-    UART0_C2 |= UART_C2_RIE;
-    UART0_C2 |= UART_C2_ILIE;
+    // Closest divisor the clock allows. If that's off by more than the
+    // tolerance, run with it anyway but flag it for uart_geterror.
+    UartBaud b;
+    if (uart_calc_baud(uart, baud, &b)){
+        u->errors |= UART_ERROR_BAUD;
+    }
+    uart_load_baud(regs, &b);
 
-    UART0_C2 |= UART_C2_TE | UART_C2_RE; // Enable UART TX/RX
+    regs->C1 |= UART_C1_ILT; // Idle count starts after STOP bit.
+    regs->C2 |= UART_C2_RIE;
+    regs->C2 |= UART_C2_ILIE;
 
-    NVIC_ENABLE_IRQ(IRQ_UART0_STATUS);
-    NVIC_SET_PRIORITY(IRQ_UART0_STATUS, 64);
+    regs->C2 |= UART_C2_TE | UART_C2_RE; // Enable UART TX/RX
+
+    // Receive errors get their own interrupt. The status ISR checks the
+    // error flags before touching RX data, so errors are still dealt with
+    // first whichever one runs.
+    u->err_held = 0;
+    regs->C3 |= UART_C3_ORIE | UART_C3_NEIE | UART_C3_FEIE | UART_C3_PEIE;
+
+    NVIC_ENABLE_IRQ(u->irq);
+    NVIC_SET_PRIORITY(u->irq, UART_IRQ_PRIORITY);
+    NVIC_ENABLE_IRQ(u->err_irq);
+    NVIC_SET_PRIORITY(u->err_irq, UART_IRQ_PRIORITY);
 
 
     return;
 }
 
 
-int uart_putc(uint8_t c)
+int uart_putc(uint32_t uart, uint8_t c)
 {
-    int ret = cb_putc(&tx_buf, c);
+    if (UART_NUM_INSTANCES <= uart){
+        return -1;
+    }
+    UartState* u = &uarts[uart];
+
+    int ret = cb_putc_masked(u->tx_buf, c, TX_BUF_MASK);
     if (ret){
-        // Buff full! Enable transmit int just in case.
-        UART0_C2 |= UART_C2_TIE;
+        // Buff full! Kick transmitter just in case.
+        UART_STAT_ADD(u, tx_full, 1);
+        uart_tx_kick(u);
         return -1;
     }
 
-    UART0_C2 |= UART_C2_TIE;
+    uart_tx_kick(u);
     return 0;
 }
 
 
-int uart_puts(uint8_t* s)
+int uart_puts(uint32_t uart, uint8_t* s)
 {
-    if (!s) return -1;
-    while (*s != '\0'){
-        int ret = uart_putc(*s);
-        if (ret){
-            return ret;
+    if (!s || UART_NUM_INSTANCES <= uart) return -1;
+    UartState* u = &uarts[uart];
+    uint32_t len = strlen((char*) s);
+    uint32_t sent = cb_write(u->tx_buf, s, len);
+    if (sent < len){
+        UART_STAT_ADD(u, tx_full, 1);
+    }
+
+    // Kick the transmitter once for the whole string.
+    uart_tx_kick(u);
+    return (sent == len) ? 0 : -1;
+}
+
+int uart_puts_wait(uint32_t uart, uint8_t* s)
+{
+    if (!s || UART_NUM_INSTANCES <= uart) return -1;
+    uint32_t len = strlen((char*) s);
+    uart_write_wait(uart, s, len, 0);
+    return 0;
+}
+
+
+// Queue len bytes of binary data. Copies into the TX ring in one step and
+// kicks the transmitter once. Returns number of bytes queued.
+uint32_t uart_write(uint32_t uart, const uint8_t* buf, uint32_t len)
+{
+    if (!buf || UART_NUM_INSTANCES <= uart) return 0;
+    UartState* u = &uarts[uart];
+    uint32_t sent = cb_write(u->tx_buf, buf, len);
+    if (sent < len){
+        UART_STAT_ADD(u, tx_full, 1);
+    }
+    if (sent){
+        uart_tx_kick(u);
+    }
+    return sent;
+}
+
+
+/*  Sleep-while-blocking calls below mask interrupts around the ring check,
+    so a wakeup can't slip in between checking and sleeping. WFI still wakes
+    on a pending interrupt with PRIMASK set, and the ISR runs as soon as
+    interrupts are unmasked. The UART/DMA ISRs wake us as ring state changes,
+    and systick for the timeout.
+*/
+#define UART_WFI() __asm__ volatile("wfi")
+
+// True once timeout_ms (nonzero) has passed since start.
+static inline int uart_timed_out(uint32_t start, uint32_t timeout_ms)
+{
+    return timeout_ms && (systick_ms - start) >= timeout_ms;
+}
+
+
+// Queue len bytes, sleeping whenever the TX ring is full. Gives up after
+// timeout_ms (0 waits forever). Returns number of bytes queued.
+uint32_t uart_write_wait(uint32_t uart, const uint8_t* buf, uint32_t len,
+                         uint32_t timeout_ms)
+{
+    if (!buf || UART_NUM_INSTANCES <= uart) return 0;
+    UartState* u = &uarts[uart];
+    uint32_t start = systick_ms;
+    uint32_t done = 0;
+
+    while (done < len){
+        uint32_t sent = cb_write(u->tx_buf, buf + done, len - done);
+        if (sent){
+            uart_tx_kick(u);
+            done += sent;
+            continue;
+        }
+#ifdef UART_STATS
+        uint32_t t0 = ARM_DWT_CYCCNT;
+#endif
+        __disable_irq();
+        if (cb_isfull(u->tx_buf)){
+            UART_WFI();
         }
-        s++;
+        __enable_irq();
+        UART_STAT_ADD(u, tx_stall_cycles, ARM_DWT_CYCCNT - t0);
+        if (uart_timed_out(start, timeout_ms)){
+            break;
+        }
+    }
+    return done;
+}
+
+
+// Pull up to len bytes out of the RX buffer. Returns number of bytes read.
+uint32_t uart_read(uint32_t uart, uint8_t* buf, uint32_t len)
+{
+    if (!buf || UART_NUM_INSTANCES <= uart) return 0;
+    UartState* u = &uarts[uart];
+    uart_rx_dma_resync(u);
+    uint32_t n = cb_read(u->rx_buf, buf, len);
+    uart_rts_drain(u);
+    return n;
+}
+
+
+// Read len bytes, sleeping whenever the RX ring is empty. Gives up after
+// timeout_ms (0 waits forever). Returns number of bytes read.
+uint32_t uart_read_wait(uint32_t uart, uint8_t* buf, uint32_t len,
+                        uint32_t timeout_ms)
+{
+    if (!buf || UART_NUM_INSTANCES <= uart) return 0;
+    UartState* u = &uarts[uart];
+    CircularBuffer* rx = u->rx_buf;
+    uint32_t start = systick_ms;
+    uint32_t done = 0;
+
+    while (done < len){
+        uart_rx_dma_resync(u);
+        uint32_t got = cb_read(rx, buf + done, len - done);
+        if (got){
+            uart_rts_drain(u);
+            done += got;
+            continue;
+        }
+        __disable_irq();
+        if (cb_isempty(rx) && !u->rx_lost){
+            UART_WFI();
+        }
+        __enable_irq();
+        if (uart_timed_out(start, timeout_ms)){
+            break;
+        }
+    }
+    return done;
+}
+
+
+/*  Read one timestamped chunk.
+    Each RX interrupt (and each DMA RX update) stamps the bytes it delivered
+    with the cycle count at ISR entry. This hands back bytes up to the end of
+    the oldest stamped chunk, with that stamp in *ts; if len is smaller than
+    the chunk, the rest comes back on the next call with the same stamp.
+    Bytes already taken with uart_read/uart_getc simply lose their stamps.
+*/
+uint32_t uart_read_frame(uint32_t uart, uint8_t* buf, uint32_t len,
+                         uint32_t* ts)
+{
+    if (!buf || !ts || UART_NUM_INSTANCES <= uart) return 0;
+    UartState* u = &uarts[uart];
+    CircularBuffer* rx = u->rx_buf;
+    uart_rx_dma_resync(u);
+    uint32_t tail = rx->tail;
+    // Taken before the stamp ring is looked at. The ISRs stamp bytes in the
+    // same pass that publishes them, so everything up to head that has a
+    // stamp already has it queued.
+    uint32_t head = rx->head;
+    UartRxStamp s;
+
+    // Skip stamps for bytes that were read some other way.
+    while (!uart_stamp_peek(u->stamps, &s) && (int32_t)(s.end - tail) <= 0){
+        uart_stamp_get(u->stamps, &s);
+    }
+
+    if (uart_stamp_peek(u->stamps, &s)){
+        // Stamp was lost to a full stamp ring. Bytes published after head
+        // was read have a stamp coming, so leave them for the next call.
+        *ts = 0;
+        if (len > head - tail){
+            len = head - tail;
+        }
+        uint32_t n = cb_read(rx, buf, len);
+        uart_rts_drain(u);
+        return n;
+    }
+
+    *ts = s.ts;
+    if (len > s.end - tail){
+        len = s.end - tail;
     }
+    uint32_t n = cb_read(rx, buf, len);
+    if (tail + n == s.end){
+        uart_stamp_get(u->stamps, &s);
+    }
+    uart_rts_drain(u);
+    return n;
+}
+
+
+int uart_getc(uint32_t uart, uint8_t* c)
+{
+    if (UART_NUM_INSTANCES <= uart){
+        return -1;
+    }
+    UartState* u = &uarts[uart];
+    CircularBuffer* rx = u->rx_buf;
+    uart_rx_dma_resync(u);
+    if (cb_isempty(rx)){
+        return -1;
+    }
+    *c = cb_getc_masked(rx, RX_BUF_MASK);
+    uart_rts_drain(u);
     return 0;
 }
 
-int uart_puts_wait(uint8_t* s)
+
+/*  Move UART TX onto a DMA channel.
+    With C5[TDMAS] set, TDRE raises a DMA request instead of an interrupt, and
+    the channel copies the TX ring straight into UARTn_D one byte per request.
+    Each span is the contiguous run from the ring tail, so the only interrupt
+    is the major loop completion at the end of a span; uart_tx_dma_isr then
+    commits the span and starts the next one.
+
+    dma_init must have been called. The application owns the channel vector
+    (see dma.h) and must call uart_tx_dma_isr(uart) from dma_chN_isr.
+*/
+int uart_tx_dma_enable(uint32_t uart, uint32_t ch)
 {
-    if (!s) return -1;
-    while(*s != '\0') {
-        if (0 == uart_putc(*s)){
-            s++;
+    if (UART_NUM_INSTANCES <= uart || DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return -1;
+    }
+    UartState* u = &uarts[uart];
+    KINETISK_UART_t* regs = u->regs;
+
+    // Stop ISR driven TX while switching over, and any earlier channel.
+    regs->C2 &= ~(UART_C2_TIE);
+    uart_dma_stop(u->tx_dma);
+    u->tx_dma = -1;
+
+    DMA_TCD tcd = {
+        .source = 0,
+        .dest = &regs->D,
+        .size = 0,      // 8 bit
+        .soff = 1,
+        .doff = 0,
+        .nbytes = 1,
+        .citer = 1,
+        .slast = 0,
+        .dlast = 0,
+        .smod = 0,
+        .dmod = 0,
+    };
+    dma_disable(ch);
+    dma_configure(ch, &tcd);
+    dma_set_oneshot(ch);
+    dma_set_int_priority(ch, UART_IRQ_PRIORITY);
+    dma_enable_int(ch);
+    dma_set_mux(ch, u->dmamux_tx);
+
+    u->tx_span = 0;
+    u->tx_dma = ch;
+    regs->C5 |= UART_C5_TDMAS;
+
+    // Send anything that queued up before the switch.
+    uart_tx_dma_start(u);
+    return 0;
+}
+
+
+/*  TX DMA completion handler.
+    Call from the isr of the channel passed to uart_tx_dma_enable.
+*/
+void uart_tx_dma_isr(uint32_t uart)
+{
+    if (UART_NUM_INSTANCES <= uart){
+        return;
+    }
+    UartState* u = &uarts[uart];
+    if (u->tx_dma < 0){
+        return;
+    }
+
+    dma_clear_int(u->tx_dma);
+    cb_commit_read(u->tx_buf, u->tx_span);
+    UART_STAT_ADD(u, tx_bytes, u->tx_span);
+    u->tx_span = 0;
+
+    if (cb_isempty(u->tx_buf)){
+        // Nothing left, so stop requesting.
+        u->regs->C2 &= ~(UART_C2_TIE);
+    }
+    uart_tx_dma_start(u);
+}
+
+
+/*  Move UART RX onto a DMA channel.
+    With C5[RDMAS] set, RDRF raises a DMA request instead of an interrupt. The
+    channel copies UARTn_D into the RX ring storage, using DMOD so the
+    destination wraps on the ring size without any software help, and runs
+    forever (BITER reloads CITER at the end of each major loop).
+
+    Software head only moves when uart_rx_dma_update reads the channel's
+    destination address: on the idle-line interrupt at the end of a burst,
+    and on the DMA interrupts at the half and end of each major loop. The
+    major loop is 2 * RX_DMA_STEP bytes, so during a long burst the ring
+    fill is checked against the RTS mark every RX_DMA_STEP bytes, and a
+    burst can't lap the reader unnoticed. The cost is one DMA interrupt per
+    RX_DMA_STEP bytes, still well under one per FIFO watermark in ISR mode.
+
+    dma_init must have been called. The application owns the channel vector
+    (see dma.h) and must call uart_rx_dma_isr(uart) from dma_chN_isr.
+*/
+int uart_rx_dma_enable(uint32_t uart, uint32_t ch)
+{
+    if (UART_NUM_INSTANCES <= uart || DMA_NUM_CHANNELS <= ch){
+        // out of range
+        return -1;
+    }
+    UartState* u = &uarts[uart];
+    KINETISK_UART_t* regs = u->regs;
+    CircularBuffer* rx = u->rx_buf;
+
+    // Hold off RX while switching over, and stop any earlier channel so
+    // only one is routed to the RX request.
+    regs->C2 &= ~(UART_C2_RIE | UART_C2_ILIE);
+    uart_dma_stop(u->rx_dma);
+    u->rx_dma = -1;
+
+    // Move what the FIFO already holds into the ring, then have DMA carry on
+    // from the ring's head, so nothing received so far is thrown away.
+    // Masked so the error ISR can't read D in between.
+    uint32_t ts = ARM_DWT_CYCCNT;
+    __disable_irq();
+    while (regs->RCFIFO){
+        if (cb_putc(rx, regs->D)){
+            u->errors |= UART_ERROR_RXOVER;
+            UART_STAT_ADD(u, rx_dropped, 1);
+        } else {
+            UART_STAT_ADD(u, rx_bytes, 1);
         }
     }
+    uart_rx_stamp(u, ts);
+    uart_rts_fill(u, cb_count(rx));
+    u->rx_lost = 0;
+    __enable_irq();
+
+    DMA_TCD tcd = {
+        .source = &regs->D,
+        .dest = rx->buf + (rx->head & RX_BUF_MASK),
+        .size = 0,      // 8 bit
+        .soff = 0,
+        .doff = 1,
+        .nbytes = 1,
+        .citer = 2 * RX_DMA_STEP,
+        .slast = 0,
+        .dlast = 0,     // DMOD wraps dest, no adjust needed
+        .smod = 0,
+        .dmod = __builtin_ctz(RX_BUF_SIZE),
+    };
+    dma_disable(ch);
+    dma_configure(ch, &tcd);
+    dma_set_int_priority(ch, UART_IRQ_PRIORITY);
+    dma_enable_int(ch);
+    dma_enable_halfint(ch);
+    dma_set_mux(ch, u->dmamux_rx);
+    dma_enable(ch);
+
+    // One request per byte. Anything that arrived since the copy above is
+    // still in the FIFO and goes out with the first requests.
+    regs->RWFIFO = 1;
+
+    u->rx_dma = ch;
+    regs->C5 |= UART_C5_RDMAS;
+    regs->C2 |= UART_C2_RIE | UART_C2_ILIE;
     return 0;
 }
 
 
-int uart_getc(uint8_t* c)
+/*  RX DMA half/full ring handler.
+    Call from the isr of the channel passed to uart_rx_dma_enable.
+*/
+void uart_rx_dma_isr(uint32_t uart)
+{
+    if (UART_NUM_INSTANCES <= uart){
+        return;
+    }
+    uint32_t ts = ARM_DWT_CYCCNT;
+    UartState* u = &uarts[uart];
+    if (u->rx_dma < 0){
+        return;
+    }
+
+    dma_clear_int(u->rx_dma);
+    uart_rx_dma_update(u, ts);
+}
+
+
+/*  Formatted output
+    Small printf for the TX ring. Characters go straight into the ring as
+    they're generated: no intermediate buffer, no heap, no newlib. Integers
+    are emitted most significant digit first by dividing down a table of
+    powers of the base, so a conversion costs at most 10 digits no matter
+    the value, and nothing ever waits for ring space. Once a character
+    doesn't fit the ring is treated as full and the rest of the output is
+    dropped, so the cost is bounded by the ring size rather than by the
+    widths passed in.
+
+    Supported: %d %i %u %x %X %c %s %p %%, with the flags '-' (left
+    justify), '0' (zero pad), '+' and ' ' (sign on positive %d/%i), '#'
+    (0x prefix on nonzero %x/%X), field width and precision, either of
+    which may be '*', all as in C: precision is the minimum number of digits
+    for integers and the maximum length for %s. 'h', 'hh', 'l', 'z' and 't'
+    are accepted and ignored (all 32 bits or promoted to int).
+
+    'll' and 'j' (64-bit) and the floating point and %o/%n conversions are
+    not supported. Their argument is still taken off the list and the spec
+    printed as is, so later arguments line up.
+
+    Fixed point has its own call, uart_putfixed, since C has no integer
+    conversion for it and the format attribute checks every spec.
+*/
+typedef struct {
+    CircularBuffer* cb;
+    uint32_t sent;
+    int full;       // set on the first character the ring refused
+} UartFmt;
+
+static const uint32_t fmt_pow10[] = {
+    1000000000, 100000000, 10000000, 1000000, 100000,
+    10000, 1000, 100, 10, 1,
+};
+
+static inline void fmt_out(UartFmt* f, char c)
+{
+    if (f->full){
+        return;
+    }
+    if (!cb_putc_masked(f->cb, c, TX_BUF_MASK)){
+        f->sent++;
+    } else {
+        f->full = 1;
+    }
+}
+
+static void fmt_pad(UartFmt* f, char c, int n)
+{
+    while (0 < n-- && !f->full){
+        fmt_out(f, c);
+    }
+}
+
+// Print v in decimal with at least prec digits (-1 if no precision was
+// given), after sign ('-', '+', ' ' or 0 for none). point is the number of
+// fractional digits for uart_putfixed, 0 for a plain integer.
+static void fmt_dec(UartFmt* f, uint32_t v, char sign, int width, int left,
+                    char pad, int prec, int point)
+{
+    // Count digits, at least one and enough to cover the fraction.
+    int ndig = 10;
+    while (1 < ndig && v < fmt_pow10[10 - ndig]){
+        ndig--;
+    }
+    if (prec == 0 && v == 0){
+        // As in C, an explicit zero precision prints no digits for 0.
+        ndig = 0;
+    }
+    if (9 < point){
+        point = 9;
+    }
+    if (point && ndig <= point){
+        ndig = point + 1;
+    }
+    int zeros = (ndig < prec) ? prec - ndig : 0;
+
+    int fill = width - (zeros + ndig + (sign ? 1 : 0) + (point ? 1 : 0));
+    if (!left && pad == ' '){
+        fmt_pad(f, ' ', fill);
+    }
+    if (sign){
+        fmt_out(f, sign);
+    }
+    if (!left && pad == '0'){
+        fmt_pad(f, '0', fill);
+    }
+    fmt_pad(f, '0', zeros);
+    for (int i = ndig; i; i--){
+        if (i == point){
+            fmt_out(f, '.');
+        }
+        uint32_t p = fmt_pow10[10 - i];
+        uint32_t d = v / p;
+        v -= d * p;
+        fmt_out(f, '0' + d);
+    }
+    if (left){
+        fmt_pad(f, ' ', fill);
+    }
+}
+
+// alt adds the C '#' prefix, 0x or 0X, to nonzero values.
+static void fmt_hex(UartFmt* f, uint32_t v, int width, int left, char pad,
+                    int prec, int upper, int alt)
+{
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    int ndig = 8;
+    while (1 < ndig && !(v >> ((ndig - 1) * 4))){
+        ndig--;
+    }
+    if (prec == 0 && v == 0){
+        ndig = 0;
+    }
+    int zeros = (ndig < prec) ? prec - ndig : 0;
+    int prefix = (alt && v) ? 2 : 0;
+
+    int fill = width - (zeros + ndig + prefix);
+    if (!left && pad == ' '){
+        fmt_pad(f, ' ', fill);
+    }
+    if (prefix){
+        fmt_out(f, '0');
+        fmt_out(f, upper ? 'X' : 'x');
+    }
+    if (!left && pad == '0'){
+        fmt_pad(f, '0', fill);
+    }
+    fmt_pad(f, '0', zeros);
+    for (int i = ndig; i; i--){
+        fmt_out(f, digits[(v >> ((i - 1) * 4)) & 0xF]);
+    }
+    if (left){
+        fmt_pad(f, ' ', fill);
+    }
+}
+
+// Print c padded to width.
+static void fmt_char(UartFmt* f, char c, int width, int left)
 {
-    if (cb_isempty(&rx_buf)){
+    if (!left){
+        fmt_pad(f, ' ', width - 1);
+    }
+    fmt_out(f, c);
+    if (left){
+        fmt_pad(f, ' ', width - 1);
+    }
+}
+
+// Print at most prec characters of s (all of it if prec is -1).
+static void fmt_str(UartFmt* f, const char* s, int width, int left, int prec)
+{
+    if (!s){
+        s = "(null)";
+    }
+    // Only right justifying needs the length up front, and only as far as
+    // width. Otherwise characters stream out until the ring fills.
+    int len = 0;
+    if (!left && width){
+        while (len < width && s[len] && len != prec){
+            len++;
+        }
+        fmt_pad(f, ' ', width - len);
+    }
+    len = 0;
+    while (s[len] && len != prec && !f->full){
+        fmt_out(f, s[len++]);
+    }
+    if (left){
+        fmt_pad(f, ' ', width - len);
+    }
+}
+
+
+int uart_vprintf(uint32_t uart, const char* fmt, va_list ap)
+{
+    if (!fmt || UART_NUM_INSTANCES <= uart) return 0;
+    UartState* u = &uarts[uart];
+    UartFmt f = { .cb = u->tx_buf, .sent = 0, .full = 0 };
+
+    for (; *fmt && !f.full; fmt++){
+        if (*fmt != '%'){
+            fmt_out(&f, *fmt);
+            continue;
+        }
+        fmt++;
+
+        const char* spec = fmt - 1;
+        int left = 0;
+        char pad = ' ';
+        char plus = 0;
+        int alt = 0;
+        int width = 0;
+        int prec = -1;
+        int wide = 0;
+
+        for (;; fmt++){
+            if (*fmt == '-'){
+                left = 1;
+            } else if (*fmt == '0'){
+                pad = '0';
+            } else if (*fmt == '+'){
+                plus = '+';
+            } else if (*fmt == ' '){
+                if (!plus){
+                    plus = ' ';
+                }
+            } else if (*fmt == '#'){
+                alt = 1;
+            } else {
+                break;
+            }
+        }
+        if (*fmt == '*'){
+            // Negative width from the argument means left justify.
+            fmt++;
+            width = va_arg(ap, int);
+            if (width < 0){
+                left = 1;
+                width = -width;
+            }
+        }
+        while ('0' <= *fmt && *fmt <= '9'){
+            width = width * 10 + (*fmt++ - '0');
+        }
+        if (*fmt == '.'){
+            fmt++;
+            prec = 0;
+            if (*fmt == '*'){
+                // Negative precision from the argument means none.
+                fmt++;
+                prec = va_arg(ap, int);
+                if (prec < 0){
+                    prec = -1;
+                }
+            }
+            while ('0' <= *fmt && *fmt <= '9'){
+                prec = prec * 10 + (*fmt++ - '0');
+            }
+        }
+        if (*fmt == 'l' || *fmt == 'h'){
+            char len = *fmt++;
+            if (*fmt == len){
+                fmt++;
+                wide = (len == 'l');
+            }
+        } else if (*fmt == 'z' || *fmt == 't'){
+            fmt++;
+        } else if (*fmt == 'j'){
+            fmt++;
+            wide = 1;
+        }
+        if (left || 0 <= prec){
+            // C ignores '0' with '-' or with a precision.
+            pad = ' ';
+        }
+
+        if (*fmt && strchr(wide ? "diouxXn" : "eEfFgGaAon", *fmt)){
+            // Not supported. Take the argument anyway so the rest line up,
+            // and show the spec.
+            if (*fmt == 'n'){
+                (void) va_arg(ap, void*);
+            } else if (wide){
+                (void) va_arg(ap, uint64_t);
+            } else if (*fmt == 'o'){
+                (void) va_arg(ap, uint32_t);
+            } else {
+                (void) va_arg(ap, double);
+            }
+            while (spec <= fmt){
+                fmt_out(&f, *spec++);
+            }
+            continue;
+        }
+
+        switch (*fmt){
+            case 'd':
+            case 'i': {
+                int32_t v = va_arg(ap, int32_t);
+                uint32_t mag = (v < 0) ? -(uint32_t) v : (uint32_t) v;
+                fmt_dec(&f, mag, (v < 0) ? '-' : plus, width, left, pad,
+                        prec, 0);
+                break;
+            }
+            case 'u':
+                fmt_dec(&f, va_arg(ap, uint32_t), 0, width, left, pad, prec,
+                        0);
+                break;
+            case 'x':
+            case 'X':
+                fmt_hex(&f, va_arg(ap, uint32_t), width, left, pad, prec,
+                        *fmt == 'X', alt);
+                break;
+            case 'p':
+                fmt_hex(&f, (uint32_t)(uintptr_t) va_arg(ap, void*), width,
+                        left, ' ', -1, 0, 1);
+                break;
+            case 'c':
+                fmt_char(&f, (char) va_arg(ap, int), width, left);
+                break;
+            case 's':
+                fmt_str(&f, va_arg(ap, const char*), width, left, prec);
+                break;
+            case '%':
+                fmt_out(&f, '%');
+                break;
+            case '\0':
+                // Dangling '%' at end of format.
+                fmt_out(&f, '%');
+                fmt--;
+                break;
+            default:
+                // Unknown conversion, print it as is.
+                fmt_out(&f, '%');
+                fmt_out(&f, *fmt);
+        }
+    }
+
+    if (f.full){
+        UART_STAT_ADD(u, tx_full, 1);
+    }
+    if (f.sent){
+        uart_tx_kick(u);
+    }
+    return f.sent;
+}
+
+
+int uart_printf(uint32_t uart, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = uart_vprintf(uart, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+
+int uart_putfixed(uint32_t uart, int32_t v, uint32_t decimals)
+{
+    if (UART_NUM_INSTANCES <= uart) return 0;
+    UartState* u = &uarts[uart];
+    UartFmt f = { .cb = u->tx_buf, .sent = 0, .full = 0 };
+
+    uint32_t mag = (v < 0) ? -(uint32_t) v : (uint32_t) v;
+    fmt_dec(&f, mag, (v < 0) ? '-' : 0, 0, 0, ' ', -1,
+            (9 < decimals) ? 9 : decimals);
+
+    if (f.full){
+        UART_STAT_ADD(u, tx_full, 1);
+    }
+    if (f.sent){
+        uart_tx_kick(u);
+    }
+    return f.sent;
+}
+
+
+/*  Hardware flow control.
+    CTS: cts_pin must be one of the instance's CTS pins (UART0: 18 or 20,
+    UART1: 23, UART2: 14). It is muxed to the UART and MODEM[TXCTSE] set, so
+    the transmitter itself holds off while CTS is high; nothing to do in
+    software. A weak pulldown keeps TX running if nothing is connected.
+
+    RTS is throttled at two levels:
+    - FIFO: on one of the instance's RTS pins (UART0: 6 or 19, UART1: 22,
+      UART2: 2) the pin is muxed to the UART and MODEM[RXRTSE] set. The
+      receiver then deasserts RTS by itself whenever the FIFO holds RWFIFO
+      bytes or more (4 of 8 with ISR RX, 1 with DMA RX or on UART2), so a
+      late status ISR at high baud rates can't overrun the FIFO.
+    - RX buffer: RTS also goes high (stop) when the RX buffer reaches 3/4
+      full, and low (go) once reads bring it back to 1/4. For a hardware
+      RTS pin this is done by switching the pin to GPIO, preset high, and
+      back to the UART afterwards.
+      ISR RX checks the fill on every FIFO drain, so the full 16 bytes
+      above the mark are slack for what the sender has in flight. DMA RX
+      only sees the fill every RX_DMA_STEP (8) bytes or at idle line, so
+      RTS can go up as late as 7 bytes past the mark, leaving at least 9
+      bytes. With DMA, RXRTSE adds nothing, since the FIFO never holds
+      more than the byte DMA is about to take.
+    Any other pin gets the RX buffer level only, as a plain GPIO.
+
+    Pass 0 for either pin to turn that side off. The previous RTS pin, if
+    any, is released first and left driving low (go) as a GPIO; uart_init
+    does the same. Returns 0 on success, -1 if cts_pin isn't a CTS pin for
+    this UART.
+*/
+int uart_set_flowctrl(uint32_t uart, uint32_t rts_pin, uint32_t cts_pin)
+{
+    if (UART_NUM_INSTANCES <= uart){
         return -1;
     }
-    *c = cb_getc(&rx_buf);
+    UartState* u = &uarts[uart];
+    KINETISK_UART_t* regs = u->regs;
+
+    volatile uint32_t* cts_pcr = 0;
+    if (cts_pin){
+        cts_pcr = uart_find_pin(uart_cts_pins,
+                                sizeof(uart_cts_pins) / sizeof(UartPin),
+                                uart, cts_pin);
+        if (!cts_pcr){
+            return -1;
+        }
+    }
+    volatile uint32_t* rts_pcr = uart_find_pin(uart_rts_pins,
+                                    sizeof(uart_rts_pins) / sizeof(UartPin),
+                                    uart, rts_pin);
+
+    regs->MODEM &= ~(UART_MODEM_TXCTSE | UART_MODEM_RXRTSE);
+    if (cts_pcr){
+        *cts_pcr = PORT_PCR_MUX(0x3) | PORT_PCR_PE;
+        regs->MODEM |= UART_MODEM_TXCTSE;
+    }
+
+    uart_rts_release(u);
+    if (rts_pin){
+        gpio_init(rts_pin, GPIO_OUT);
+        if (rts_pcr){
+            // Preset the GPIO level the buffer throttle uses, then hand the
+            // pin to the receiver.
+            gpio_set(rts_pin);
+            *rts_pcr = PORT_PCR_MUX(0x3);
+            regs->MODEM |= UART_MODEM_RXRTSE;
+        } else {
+            gpio_clr(rts_pin);
+        }
+
+        __disable_irq();
+        u->rts_pin = rts_pin;
+        u->rts_pcr = rts_pcr;
+        __enable_irq();
+        // Buffer may already be past the mark.
+        uart_rts_fill(u, cb_count(u->rx_buf));
+    }
     return 0;
 }
 
 
-void uart_setparity(uint8_t type)
+int uart_calc_baud(uint32_t uart, uint32_t baud, UartBaud* out)
 {
+    if (!out || UART_NUM_INSTANCES <= uart){
+        return UART_BAUD_INVALID;
+    }
+    UartState* u = &uarts[uart];
+    int ret = UART_BAUD_OK;
+
+    // Out of range rates still get the nearest setting filled in.
+    if (!baud){
+        baud = 1;
+    }
+    uint32_t div = ((u->clock * 2) + (baud >> 1)) / baud;
+    if (div < UART_DIV_MIN){
+        div = UART_DIV_MIN;
+        ret = UART_BAUD_INVALID;
+    } else if (div > UART_DIV_MAX){
+        div = UART_DIV_MAX;
+        ret = UART_BAUD_INVALID;
+    }
+
+    out->sbr = div >> 5;
+    out->brfa = div & 0x1F;
+    out->clock = u->clock;
+    out->actual = ((u->clock * 2) + (div >> 1)) / div;
+    out->error_ppm = (int32_t) (((int64_t) out->actual - baud) * 1000000
+                                / (int64_t) baud);
+    out->max_byte_rate = out->actual / (u->frame_bits ? u->frame_bits : 10);
+
+    uint32_t err = (out->error_ppm < 0) ? -out->error_ppm : out->error_ppm;
+    if (ret == UART_BAUD_OK && err > UART_BAUD_TOLERANCE_PPM){
+        ret = UART_BAUD_INEXACT;
+    }
+    return ret;
+}
+
+
+int uart_set_baud(uint32_t uart, uint32_t baud, UartBaud* out)
+{
+    UartBaud b;
+    int ret = uart_calc_baud(uart, baud, &b);
+    if (UART_NUM_INSTANCES <= uart){
+        return ret;
+    }
+    if (out){
+        *out = b;
+    }
+    if (ret != UART_BAUD_OK){
+        // Refuse rather than run at a rate the other end may not follow.
+        return ret;
+    }
+
+    // Change the divisor with the transmitter and receiver off.
+    KINETISK_UART_t* regs = uarts[uart].regs;
+    uint8_t c2 = regs->C2;
+    regs->C2 = c2 & ~(UART_C2_TE | UART_C2_RE);
+    uart_load_baud(regs, &b);
+    regs->C2 = c2;
+    return UART_BAUD_OK;
+}
+
+
+void uart_setparity(uint32_t uart, uint8_t type)
+{
+    if (UART_NUM_INSTANCES <= uart){
+        return;
+    }
+    UartState* u = &uarts[uart];
+    KINETISK_UART_t* regs = u->regs;
+
+    // Parity goes in a 9th bit, so 8 data bits still fit.
     switch(type){
         case (UART_EVEN_PARITY):
-            UART0_C1 &= ~(UART_C1_PT);
-            UART0_C1 |= UART_C1_PE | UART_C1_M;
+            regs->C1 &= ~(UART_C1_PT);
+            regs->C1 |= UART_C1_PE | UART_C1_M;
+            u->frame_bits = 11;
             break;
         case (UART_ODD_PARITY):
-            UART0_C1 |= UART_C1_PE | UART_C1_PT | UART_C1_M;
+            regs->C1 |= UART_C1_PE | UART_C1_PT | UART_C1_M;
+            u->frame_bits = 11;
             break;
         default:
-            UART0_C1 &= ~(UART_C1_PE);
+            regs->C1 &= ~(UART_C1_PE | UART_C1_M);
+            u->frame_bits = 10;
     }
     return;
 }
 
 
-uint32_t uart_geterror(void)
+uint32_t uart_geterror(uint32_t uart)
 {
-    uint32_t e = (uint32_t) uart_errors;
-    uart_errors = 0;
+    if (UART_NUM_INSTANCES <= uart){
+        return 0;
+    }
+    UartState* u = &uarts[uart];
+    uint32_t e = (uint32_t) u->errors;
+    u->errors = 0;
     return e;
 }
 
 
-/*  UART0 Status ISR
-    Handles UART0 RX and TX.
+// Copy out a consistent snapshot of the counters. Returns -1 (and zeros)
+// if the driver was built without UART_STATS.
+int uart_get_stats(uint32_t uart, UartStats* out)
+{
+    if (!out || UART_NUM_INSTANCES <= uart){
+        return -1;
+    }
+#ifdef UART_STATS
+    __disable_irq();
+    *out = uarts[uart].stats;
+    __enable_irq();
+    return 0;
+#else
+    memset(out, 0, sizeof(*out));
+    return -1;
+#endif
+}
+
+
+void uart_reset_stats(uint32_t uart)
+{
+    if (UART_NUM_INSTANCES <= uart){
+        return;
+    }
+#ifdef UART_STATS
+    __disable_irq();
+    memset(&uarts[uart].stats, 0, sizeof(UartStats));
+    __enable_irq();
+#endif
+}
+
+
+/*  Receive error handling
+    Error flags clear on a read of S1 with the flag set followed by a read
+    of D. With the FIFO on, the flags don't say which FIFO entry is bad, so
+    D is only read here when the FIFO contents are being thrown away anyway.
+    The error interrupt runs at the status interrupt's priority, so neither
+    preempts the other halfway through a FIFO drain, and the D reads here
+    still run with interrupts masked and RCFIFO re-read inside the window.
+
+    Framing and parity errors usually mean the receiver is out of step with
+    the bit stream, so the FIFO is flushed and the receiver picks up again
+    at the next start bit. If the FIFO was already empty, the D read that
+    clears the flags underflows, so RXUF is cleared too.
+
+    Overrun has lost the bytes that didn't fit, but the ones already in the
+    FIFO are good, and noise can't be pinned on any one of them, so neither
+    drops data. If the FIFO is empty, the flags are cleared at once with
+    the same D read and flush as the IDLE clear. Otherwise the RX path's
+    next D read completes the clear; the error's interrupt enable is held
+    off until then, so the error interrupt doesn't keep firing over it, and
+    uart_rx_error_release puts it back. The flag stays set in S1 over that
+    time too, and the status ISR sees it on every pass until the D read,
+    so while held it has already been counted and is ignored here.
+
+    With RX on DMA, D belongs to the DMA channel: a CPU read could take a
+    byte a pending request was about to move. Every error is held as above
+    and the DMA's next D read (or the IDLE clear) clears it. Bytes already
+    moved can't be flushed, so framing and parity errors drop nothing there.
+*/
+#define UART_RX_ERRORS (UART_S1_OR | UART_S1_NF | UART_S1_FE | UART_S1_PF)
+
+// C3 interrupt enable for each S1 error flag.
+static uint8_t uart_rx_error_ie(uint8_t status)
+{
+    uint8_t ie = 0;
+    if (status & UART_S1_OR) ie |= UART_C3_ORIE;
+    if (status & UART_S1_NF) ie |= UART_C3_NEIE;
+    if (status & UART_S1_FE) ie |= UART_C3_FEIE;
+    if (status & UART_S1_PF) ie |= UART_C3_PEIE;
+    return ie;
+}
+
+static void uart_rx_error(UartState* u, uint8_t status)
+{
+    KINETISK_UART_t* regs = u->regs;
+    uint8_t err = 0;
+
+    status &= UART_RX_ERRORS & ~u->err_held;
+    if (!status){
+        return;
+    }
+
+    __disable_irq();
+    if (0 <= u->rx_dma){
+        regs->C3 &= ~uart_rx_error_ie(status);
+        u->err_held |= status;
+    } else if (status & (UART_S1_FE | UART_S1_PF)){
+        uint8_t empty = (regs->RCFIFO == 0);
+        (void) regs->D;
+        regs->CFIFO = UART_CFIFO_RXFLUSH;
+        if (empty){
+            regs->SFIFO = UART_SFIFO_RXUF;
+        }
+    } else if (regs->RCFIFO == 0){
+        (void) regs->D;
+        regs->CFIFO = UART_CFIFO_RXFLUSH;
+    } else {
+        regs->C3 &= ~uart_rx_error_ie(status);
+        u->err_held |= status;
+    }
+    __enable_irq();
+
+    if (status & UART_S1_OR){
+        err |= UART_ERROR_OVERRUN;
+        UART_STAT_ADD(u, overrun, 1);
+    }
+    if (status & UART_S1_NF){
+        err |= UART_ERROR_NOISE;
+        UART_STAT_ADD(u, noise, 1);
+    }
+    if (status & UART_S1_FE){
+        err |= UART_ERROR_FRAMING;
+        UART_STAT_ADD(u, framing, 1);
+    }
+    if (status & UART_S1_PF){
+        err |= UART_ERROR_PARITY;
+        UART_STAT_ADD(u, parity, 1);
+    }
+    u->errors |= err;
+}
+
+
+
+/*  UART Error ISR
+    Enabled through C3[ORIE/NEIE/FEIE/PEIE]. Recovers in place rather than
+    falling through to fault_isr.
+*/
+static void uart_error_isr(UartState* u)
+{
+    uint8_t status = u->regs->S1;
+    if (status & UART_RX_ERRORS){
+        uart_rx_error(u, status);
+    }
+}
+
+
+/*  UART Status ISR
+    Handles RX and TX for one instance. uart0/1/2_status_isr below override
+    the weak vectors in mk20dx128.c and call this with their state.
 
     This ISR borrows from the Teensyduino Core Library for the RX handling.
     Freescale did some weirdness with the RX machinery and Paul figured out how
     to cover all the edge cases. See note below.
 
-    Tested: ISR takes around 11us with default Teensy3.2. At 115200 constant
-    transmission, tx empties every 575us.
+    S1 and C2 are read once, RCFIFO once per RX pass and TCFIFO once per TX
+    pass. RX bytes go straight into ring storage with a single head update,
+    and TX is fed from contiguous ring spans rather than a ring call per
+    byte. Interrupts are only masked for the IDLE-clear sequence and in
+    uart_rx_error.
+
+    Tested on the old per-byte version only: ISR took around 11us with
+    default Teensy3.2. At 115200 constant transmission, tx empties every
+    575us. No figure exists for this version, so no speedup is claimed.
+    -DUART_STATS builds count ISR cycles (isr_cycles, isr_cycles_max) in
+    the vector wrappers below, around the whole handler.
 */
-void uart0_status_isr(void)
+static void uart_status_isr(UartState* u)
 {
-    uint8_t avail, c;
-    uint8_t status = UART0_S1;
+    uint32_t ts = ARM_DWT_CYCCNT;
+    KINETISK_UART_t* regs = u->regs;
+    uint8_t status = regs->S1;  // also the S1 read half of the TDRE clear
+    uint8_t c2 = regs->C2;
+
+    if (status & UART_RX_ERRORS){
+        // Error interrupt hasn't got to it yet, or it's a held error that
+        // uart_rx_error skips. Either way it's dealt with before RCFIFO is
+        // read below.
+        uart_rx_error(u, status);
+    }
 
     /*  RECEIVER INTERRUPT */
-    if (status & (UART_S1_RDRF | UART_S1_IDLE)){
-        __disable_irq();
-        avail = UART0_RCFIFO;
+    if (0 <= u->rx_dma){
+        // RDRF goes to DMA; only idle-line lands here.
+        if (status & UART_S1_IDLE){
+            // Same IDLE clear as below. DMA keeps the FIFO drained, so
+            // RCFIFO is normally 0 by the time the line goes idle.
+            __disable_irq();
+            if (regs->RCFIFO == 0){
+                (void) regs->D;
+                regs->CFIFO = UART_CFIFO_RXFLUSH;
+            }
+            __enable_irq();
+            uart_rx_dma_update(u, ts);
+        }
+    } else if (status & (UART_S1_RDRF | UART_S1_IDLE)){
+        uint32_t avail = regs->RCFIFO;
+        UART_STAT_MAX(u, rx_fifo_peak, avail);
         if (avail == 0){
             // IDLE-handling code from Teensyduino (serial1.c). Freescale
             // engineers making life difficult.
             // To clear IDLE, need to read DATA, but if nothing's available, then
             // that will cause an underrun, so we clear that with a flush, but
             // hopefully we don't receive a character during this in-between time.
-            c = UART0_D;
-            UART0_CFIFO = UART_CFIFO_RXFLUSH;
+            // Only this sequence needs interrupts off, so recheck inside.
+            __disable_irq();
+            if (regs->RCFIFO == 0){
+                (void) regs->D;
+                regs->CFIFO = UART_CFIFO_RXFLUSH;
+            }
             __enable_irq();
         } else {
-            __enable_irq();
-            if (status & UART_S1_PF){
-                // Parity Error
-                c = UART0_D;
-                UART0_CFIFO = UART_CFIFO_RXFLUSH;
-                uart_errors |= UART_ERROR_PARITY;
-            }
-            while (UART0_RCFIFO){
-                c = UART0_D;
-                if (cb_putc(&rx_buf, c)){
-                    // Ring buffer is full
-                    uart_errors |= UART_ERROR_RXOVER;
+            // Copy what the FIFO holds right into ring storage and publish
+            // it in one go. Anything arriving meanwhile raises RDRF or IDLE
+            // again.
+            CircularBuffer* rx = u->rx_buf;
+            uint8_t* buf = (uint8_t*) rx->buf;
+            uint32_t head = rx->head;
+            uint32_t room = RX_BUF_SIZE - (head - rx->tail);
+            uint32_t n = (avail < room) ? avail : room;
+            for (uint32_t i = 0; i < n; i++){
+                buf[(head + i) & RX_BUF_MASK] = regs->D;
+            }
+            if (n){
+                cb_commit_write(rx, n);
+                UART_STAT_ADD(u, rx_bytes, n);
+                UART_STAT_MAX(u, rx_buf_peak, head + n - rx->tail);
+                uart_rts_fill(u, head + n - rx->tail);
+            }
+            if (n < avail){
+                // Ring buffer is full. Drain the FIFO anyway.
+                UART_STAT_ADD(u, rx_dropped, avail - n);
+                for (; n < avail; n++){
+                    (void) regs->D;
                 }
+                u->errors |= UART_ERROR_RXOVER;
             }
+            uart_rx_stamp(u, ts);
         }
+        uart_rx_error_release(u);
     }
 
     /* TRANSMITTER INTERRUPT */
-    if (UART0_C2 & UART_C2_TIE) {
-        if (cb_isempty(&tx_buf)){
-            // If we emptied the buffer, then turn off fifo interrupt.
-            UART0_C2 &= ~(UART_C2_TIE);
-        } else if (UART0_S1 & UART_S1_TDRE){
-            // fifo is empty and cb has data, so fill the fifo.
-            do {
-                status = UART0_S1;
-                UART0_D = cb_getc(&tx_buf);
-                if (cb_isempty(&tx_buf)){
+    // With TX on DMA, TIE raises DMA requests rather than this interrupt.
+    if ((c2 & UART_C2_TIE) && u->tx_dma < 0) {
+        CircularBuffer* tx = u->tx_buf;
+        if (status & UART_S1_TDRE){
+            // Top up the fifo from at most two ring spans: to the end of
+            // storage, then from the start.
+            uint32_t room = (1 < u->fifo_depth)
+                          ? u->fifo_depth - regs->TCFIFO : 1;
+            uint8_t* p;
+            for (int i = 0; i < 2 && room; i++){
+                uint32_t n = cb_peek_contiguous(tx, &p);
+                if (!n){
                     break;
                 }
-            } while (UART0_TCFIFO < FIFO_DEPTH);
+                if (n > room){
+                    n = room;
+                }
+                for (uint32_t j = 0; j < n; j++){
+                    regs->D = p[j];
+                }
+                cb_commit_read(tx, n);
+                UART_STAT_ADD(u, tx_bytes, n);
+                room -= n;
+            }
+        }
+        if (cb_isempty(tx)){
+            // If we emptied the buffer, then turn off fifo interrupt. A
+            // writer may have queued more and set TIE just before this, so
+            // check again after clearing.
+            regs->C2 &= ~(UART_C2_TIE);
+            if (!cb_isempty(tx)){
+                regs->C2 |= UART_C2_TIE;
+            }
         }
     }
 }
 
 
+// Run the status handler for u, timing it when built with UART_STATS.
+static inline void uart_status_vector(UartState* u)
+{
+#ifdef UART_STATS
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    uart_status_isr(u);
+    uint32_t cycles = ARM_DWT_CYCCNT - t0;
+    u->stats.isr_count++;
+    u->stats.isr_cycles += cycles;
+    UART_STAT_MAX(u, isr_cycles_max, cycles);
+#else
+    uart_status_isr(u);
+#endif
+}
+
+void uart0_status_isr(void)
+{
+    uart_status_vector(&uarts[UART0]);
+}
+
+void uart1_status_isr(void)
+{
+    uart_status_vector(&uarts[UART1]);
+}
+
+void uart2_status_isr(void)
+{
+    uart_status_vector(&uarts[UART2]);
+}
+
+
+void uart0_error_isr(void)
+{
+    uart_error_isr(&uarts[UART0]);
+}
+
+void uart1_error_isr(void)
+{
+    uart_error_isr(&uarts[UART1]);
+}
+
+void uart2_error_isr(void)
+{
+    uart_error_isr(&uarts[UART2]);
+}
@@ -0,0 +1,300 @@
+/*
+    binlog_decode.c - render binlog records as text on the host
+
+    Usage: binlog_decode [-f hz] [-b baud] <elf> [device]
+
+    Reads the binlog_fmt section out of the firmware ELF, then decodes the
+    record stream from device (a serial port, a pty, or a file) or stdin.
+    Serial ports and ptys are switched to raw mode first. Each record prints
+    as "[timestamp] text": the timestamp is in cycles, or in seconds when -f
+    gives the cycle counter frequency, extended past the 32-bit wrap. Records
+    are printed in arrival order, which can be slightly out of timestamp
+    order when several ISRs log. Bytes that don't start a valid record
+    are skipped until the stream lines up again.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <elf.h>
+#include "binlog.h"
+
+static const char* fmt_sec;
+static uint32_t fmt_size;
+
+static uint32_t le32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Load the whole ELF and point fmt_sec at its binlog_fmt section. Handles
+// 32-bit (target) and 64-bit (host test) little-endian files.
+static int load_elf(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f){
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* img = malloc(len);
+    if (!img || fread(img, 1, len, f) != (size_t) len){
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if (len < EI_NIDENT || memcmp(img, ELFMAG, SELFMAG)
+        || img[EI_DATA] != ELFDATA2LSB){
+        fprintf(stderr, "%s: not a little-endian ELF\n", path);
+        return -1;
+    }
+
+    uint64_t shoff;
+    uint32_t shentsize, shnum, shstrndx;
+    if (img[EI_CLASS] == ELFCLASS32){
+        Elf32_Ehdr* eh = (Elf32_Ehdr*) img;
+        shoff = eh->e_shoff;
+        shentsize = eh->e_shentsize;
+        shnum = eh->e_shnum;
+        shstrndx = eh->e_shstrndx;
+    } else {
+        Elf64_Ehdr* eh = (Elf64_Ehdr*) img;
+        shoff = eh->e_shoff;
+        shentsize = eh->e_shentsize;
+        shnum = eh->e_shnum;
+        shstrndx = eh->e_shstrndx;
+    }
+
+    // Pull name, offset and size out of section header i.
+    #define SH_FIELD(i, field) ((img[EI_CLASS] == ELFCLASS32) \
+        ? (uint64_t) ((Elf32_Shdr*) (img + shoff + (i) * shentsize))->field \
+        : (uint64_t) ((Elf64_Shdr*) (img + shoff + (i) * shentsize))->field)
+
+    if (shoff + (uint64_t) shnum * shentsize > (uint64_t) len
+        || shstrndx >= shnum){
+        fprintf(stderr, "%s: bad section headers\n", path);
+        return -1;
+    }
+    const char* names = (const char*) img + SH_FIELD(shstrndx, sh_offset);
+    for (uint32_t i = 0; i < shnum; i++){
+        if (strcmp(names + SH_FIELD(i, sh_name), "binlog_fmt") == 0){
+            fmt_sec = (const char*) img + SH_FIELD(i, sh_offset);
+            fmt_size = SH_FIELD(i, sh_size);
+            return 0;
+        }
+    }
+    fprintf(stderr, "%s: no binlog_fmt section\n", path);
+    return -1;
+}
+
+// Length of the conversion spec at s (just past a '%'), or 0 if it isn't
+// one binlog can print.
+static int spec_len(const char* s)
+{
+    int n = strspn(s, "-+ #0123456789.l");
+    return strchr("diuxXc%", s[n]) && s[n] ? n + 1 : 0;
+}
+
+// Number of arguments fmt consumes, or -1 if it has an unsupported spec.
+static int count_args(const char* fmt)
+{
+    int n = 0;
+    for (; *fmt; fmt++){
+        if (*fmt != '%'){
+            continue;
+        }
+        int len = spec_len(fmt + 1);
+        if (!len){
+            return -1;
+        }
+        if (fmt[len] != '%'){
+            n++;
+        }
+        fmt += len;
+    }
+    return n;
+}
+
+static void render(const char* fmt, const uint32_t* args)
+{
+    char spec[32];
+    for (; *fmt; fmt++){
+        if (*fmt != '%'){
+            putchar(*fmt);
+            continue;
+        }
+        int len = spec_len(fmt + 1);
+        char conv = fmt[len];
+        if (conv == '%'){
+            putchar('%');
+        } else {
+            // Copy the spec without length modifiers; args are 32 bits.
+            int j = 0;
+            for (int i = 0; i <= len && j < (int) sizeof(spec) - 1; i++){
+                if (fmt[i] != 'l'){
+                    spec[j++] = fmt[i];
+                }
+            }
+            spec[j] = 0;
+            if (conv == 'd' || conv == 'i'){
+                printf(spec, (int32_t) *args++);
+            } else {
+                printf(spec, *args++);
+            }
+        }
+        fmt += len;
+    }
+    putchar('\n');
+}
+
+// Put a serial port or pty into raw mode at baud (0 = leave speed alone).
+static void set_raw(int fd, int baud)
+{
+    struct termios t;
+    if (tcgetattr(fd, &t)){
+        return; // not a tty
+    }
+    cfmakeraw(&t);
+    if (baud){
+        speed_t sp = (baud == 115200) ? B115200 : (baud == 230400) ? B230400
+                   : (baud == 460800) ? B460800 : (baud == 921600) ? B921600
+                   : (baud == 1000000) ? B1000000 : (baud == 2000000)
+                   ? B2000000 : B9600;
+        cfsetispeed(&t, sp);
+        cfsetospeed(&t, sp);
+    }
+    tcsetattr(fd, TCSANOW, &t);
+}
+
+int main(int argc, char** argv)
+{
+    double hz = 0;
+    int baud = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:b:")) != -1){
+        if (opt == 'f'){
+            hz = atof(optarg);
+        } else if (opt == 'b'){
+            baud = atoi(optarg);
+        } else {
+            fprintf(stderr,
+                    "usage: %s [-f hz] [-b baud] <elf> [device]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc || load_elf(argv[optind])){
+        fprintf(stderr,
+                "usage: %s [-f hz] [-b baud] <elf> [device]\n", argv[0]);
+        return 2;
+    }
+
+    int fd = 0;
+    if (optind + 1 < argc){
+        fd = open(argv[optind + 1], O_RDONLY | O_NOCTTY);
+        if (fd < 0){
+            perror(argv[optind + 1]);
+            return 1;
+        }
+    }
+    set_raw(fd, baud);
+
+    static uint8_t buf[8192];
+    uint32_t have = 0;
+    uint64_t newest = 0;    // extended timestamp of the latest record so far
+    int have_ts = 0;
+    unsigned long skipped = 0;
+
+    for (;;){
+        ssize_t n = read(fd, buf + have, sizeof(buf) - have);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            // EOF, or EIO once the other end of a pty goes away.
+            break;
+        }
+        have += n;
+
+        uint32_t pos = 0;
+        while (have - pos >= 8){
+            uint32_t hdr = le32(buf + pos);
+            uint32_t nargs = (hdr >> BINLOG_NARGS_SHIFT) & 0xF;
+            uint32_t id = hdr & BINLOG_ID_MASK;
+            if ((hdr & BINLOG_MAGIC_MASK) != BINLOG_MAGIC
+                || nargs > BINLOG_MAX_ARGS || id >= fmt_size
+                || (id && fmt_sec[id - 1] != 0)
+                || count_args(fmt_sec + id) != (int) nargs){
+                // Not a record boundary, slide forward a byte.
+                pos++;
+                skipped++;
+                continue;
+            }
+            uint32_t reclen = 4 * (2 + nargs);
+            if (have - pos < reclen){
+                break;
+            }
+
+            uint32_t args[BINLOG_MAX_ARGS];
+            uint32_t ts = le32(buf + pos + 4);
+            for (uint32_t i = 0; i < nargs; i++){
+                args[i] = le32(buf + pos + 8 + 4 * i);
+            }
+            // Extend the 32-bit counter across wraps. A producer takes its
+            // timestamp before claiming a slot, so with several ISRs logging,
+            // records can arrive slightly out of order. Work from the signed
+            // distance to the newest timestamp so far: a small step back is
+            // such a record, and only a drop of more than 2^31 is a wrap.
+            // Needs a record at least every 2^31 cycles (29.8 s at 72 MHz).
+            if (!have_ts){
+                newest = ts;
+                have_ts = 1;
+            }
+            int32_t delta = (int32_t)(ts - (uint32_t) newest);
+            uint64_t full = newest + delta;
+            if (0 < delta){
+                newest = full;
+            }
+
+            if (hz){
+                printf("[%12.6f] ", full / hz);
+            } else {
+                printf("[%12llu] ", (unsigned long long) full);
+            }
+            render(fmt_sec + id, args);
+            pos += reclen;
+        }
+        memmove(buf, buf + pos, have - pos);
+        have -= pos;
+        fflush(stdout);
+    }
+
+    if (skipped){
+        fprintf(stderr, "binlog_decode: skipped %lu bytes\n", skipped);
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+    binlog_demo.c - end-to-end host test for binlog
+
+    Usage: binlog_demo <path to binlog_decode>
+
+    Builds drivers/binlog.c natively, with a pty standing in for the serial
+    port: uart_write below writes to the pty master, and binlog_decode is
+    started on the slave side with this program as its ELF. Every record is
+    also formatted locally with snprintf, and the decoder's output has to
+    match line for line, timestamp included. Some junk bytes are sent partway
+    through to check that the decoder finds its way back to record
+    boundaries. The fake cycle counter wraps partway through, and some
+    records carry a timestamp older than the one before them, as happens
+    when a producer is preempted between taking its timestamp and claiming
+    its slot; neither may throw off the decoded timestamps. Build and run
+    with `make binlog-test`.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "binlog.h"
+#include "uart.h"
+
+#define DEMO_RECORDS (2000)
+
+static int master_fd;
+static uint64_t fake_cycles = (1ull << 32) - 50000;  // wraps partway through
+static uint64_t last_stamp;
+static uint32_t stamps;
+static int wrap_straggled;
+
+// Timestamp source for the host build (see BINLOG_TIMESTAMP in Makefile).
+// Time advances 72 cycles per record, except that every 7th record, and
+// the first one after the counter wraps, is a straggler stamped 100 cycles
+// before the newest time. The full 64-bit time is kept in last_stamp.
+uint32_t demo_timestamp(void)
+{
+    int straggle = (++stamps % 7 == 0);
+    if (!wrap_straggled && (fake_cycles >> 32) && (uint32_t) fake_cycles < 100){
+        straggle = wrap_straggled = 1;
+    }
+    last_stamp = straggle ? fake_cycles - 100 : (fake_cycles += 72);
+    return (uint32_t) last_stamp;
+}
+
+// Stand-in for the UART driver: everything goes out the pty.
+uint32_t uart_write(uint32_t uart, const uint8_t* buf, uint32_t len)
+{
+    uint32_t done = 0;
+    while (done < len){
+        ssize_t n = write(master_fd, buf + done, len - done);
+        if (n <= 0){
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2){
+        fprintf(stderr, "usage: %s <binlog_decode>\n", argv[0]);
+        return 2;
+    }
+
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) || unlockpt(master_fd)){
+        perror("pty");
+        return 1;
+    }
+    const char* slave = ptsname(master_fd);
+
+    // Raw mode on the slave before anything is written, so no byte gets
+    // translated or echoed. Keep it open so the setting sticks.
+    int slave_fd = open(slave, O_RDWR | O_NOCTTY);
+    struct termios t;
+    tcgetattr(slave_fd, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave_fd, TCSANOW, &t);
+
+    // The decoder reads format strings out of this program's own ELF.
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len < 0){
+        perror("readlink");
+        return 1;
+    }
+    self[len] = 0;
+
+    // Decoder output goes to a temp file, so it never blocks on us.
+    FILE* out = tmpfile();
+    pid_t pid = fork();
+    if (pid == 0){
+        // Drop our ends of the pty, or the decoder never sees the hangup.
+        close(master_fd);
+        close(slave_fd);
+        dup2(fileno(out), 1);
+        execl(argv[1], argv[1], self, slave, (char*) 0);
+        perror(argv[1]);
+        _exit(1);
+    }
+
+    binlog_init(0);
+
+    // Expected output, one line per record, and its full timestamp.
+    char** expect = calloc(DEMO_RECORDS, sizeof(char*));
+    uint64_t* expect_ts = calloc(DEMO_RECORDS, sizeof(uint64_t));
+    for (int i = 0; i < DEMO_RECORDS; i++){
+        char line[128];
+        int32_t temp = 2150 - 7 * i;
+        uint32_t flags = (i * 0x1021) & 0xFFFF;
+        switch (i % 4){
+            case 0:
+                BINLOG("boot");
+                snprintf(line, sizeof(line), "boot");
+                break;
+            case 1:
+                BINLOG("sample %u: temp %d, flags 0x%04x", i, temp, flags);
+                snprintf(line, sizeof(line), "sample %u: temp %d, flags 0x%04x",
+                         i, temp, flags);
+                break;
+            case 2:
+                BINLOG("%c%c %5d|%-5u| 100%%", 'o', 'k', -i, i);
+                snprintf(line, sizeof(line), "%c%c %5d|%-5u| 100%%",
+                         'o', 'k', -i, i);
+                break;
+            default:
+                BINLOG("%lu %lu %lu %lu %lu %lu %lu %lX", 1, 2, 3, 4, 5, 6, 7,
+                       0xDEADBEEF);
+                snprintf(line, sizeof(line), "1 2 3 4 5 6 7 DEADBEEF");
+        }
+        expect[i] = strdup(line);
+        expect_ts[i] = last_stamp;
+
+        if (i % 16 == 15){
+            binlog_flush();
+        }
+        if (i == DEMO_RECORDS / 2){
+            // Junk on the wire.
+            static const uint8_t junk[] = {0xB0, 0x00, 0x13, 0x37, 0xFF, 0xB7};
+            binlog_flush();
+            uart_write(0, junk, sizeof(junk));
+        }
+    }
+    binlog_flush();
+
+    // Wait for the decoder to drain the pty before hanging up.
+    int queued, status;
+    pid_t done = 0;
+    while (ioctl(slave_fd, FIONREAD, &queued) == 0 && queued){
+        done = waitpid(pid, &status, WNOHANG);
+        if (done){
+            break; // decoder died early
+        }
+        usleep(1000);
+    }
+    close(master_fd);
+    close(slave_fd);
+
+    if (!done){
+        waitpid(pid, &status, 0);
+    }
+    rewind(out);
+
+    char line[256];
+    int n = 0, bad = 0;
+    while (fgets(line, sizeof(line), out)){
+        line[strcspn(line, "\n")] = 0;
+        char* text = strstr(line, "] ");
+        unsigned long long ts = 0;
+        if (!text || n >= DEMO_RECORDS || strcmp(text + 2, expect[n])
+            || sscanf(line, "[%llu]", &ts) != 1 || ts != expect_ts[n]){
+            if (bad++ < 5){
+                printf("line %d: got \"%s\", want \"[%llu] %s\"\n", n, line,
+                       n < DEMO_RECORDS ? (unsigned long long) expect_ts[n] : 0,
+                       n < DEMO_RECORDS ? expect[n] : "(nothing)");
+            }
+        }
+        n++;
+    }
+
+    if (n != DEMO_RECORDS || bad || binlog_dropped() || !wrap_straggled){
+        printf("binlog: FAILED (%d of %d lines, %d bad, %u dropped)\n",
+               n, DEMO_RECORDS, bad, (unsigned) binlog_dropped());
+        return 1;
+    }
+    printf("binlog: %d records decoded ok\n", n);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+    cb_bench.c - host benchmark for the circular buffer library
+
+    Builds drivers/circbuff.c natively and compares the per-byte path
+    (cb_putc/cb_getc) against the bulk path (cb_write/cb_read). Each pass
+    pushes a chunk through the ring and drains it again, so every copy
+    crosses the wrap point on a regular basis. Build and run with
+    `make bench`.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "circbuff.h"
+
+// Total bytes pushed through the ring per measurement.
+#define BENCH_BYTES (64u * 1024u * 1024u)
+
+static uint8_t storage[4096];
+static uint8_t src[4096];
+static uint8_t dst[4096];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Move BENCH_BYTES through the ring one byte per call.
+static double run_bytewise(uint32_t size, uint32_t chunk)
+{
+    CircularBuffer cb;
+    cb_init(&cb, storage, size);
+
+    double start = now_ns();
+    for (uint32_t done = 0; done < BENCH_BYTES; done += chunk){
+        for (uint32_t i = 0; i < chunk; i++){
+            cb_putc(&cb, src[i]);
+        }
+        for (uint32_t i = 0; i < chunk; i++){
+            dst[i] = cb_getc(&cb);
+        }
+    }
+    return BENCH_BYTES / (now_ns() - start);
+}
+
+// Move BENCH_BYTES through the ring with one call per chunk.
+static double run_bulk(uint32_t size, uint32_t chunk)
+{
+    CircularBuffer cb;
+    cb_init(&cb, storage, size);
+
+    double start = now_ns();
+    for (uint32_t done = 0; done < BENCH_BYTES; done += chunk){
+        cb_write(&cb, src, chunk);
+        cb_read(&cb, dst, chunk);
+    }
+    return BENCH_BYTES / (now_ns() - start);
+}
+
+int main(void)
+{
+    static const uint32_t sizes[] = {64, 1024, 4096};
+    static const uint32_t chunks[] = {8, 23, 48};
+
+    for (uint32_t i = 0; i < sizeof(src); i++){
+        src[i] = (uint8_t) rand();
+    }
+
+    printf("%6s %6s %14s %14s %8s\n",
+           "ring", "chunk", "bytewise B/ns", "bulk B/ns", "speedup");
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        for (unsigned c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++){
+            // Check each pass's output before the next one overwrites it.
+            memset(dst, 0, sizeof(dst));
+            double bw = run_bytewise(sizes[s], chunks[c]);
+            if (memcmp(src, dst, chunks[c])){
+                printf("bytewise: data mismatch at ring %u chunk %u\n",
+                       (unsigned) sizes[s], (unsigned) chunks[c]);
+                return 1;
+            }
+            memset(dst, 0, sizeof(dst));
+            double bk = run_bulk(sizes[s], chunks[c]);
+            if (memcmp(src, dst, chunks[c])){
+                printf("bulk: data mismatch at ring %u chunk %u\n",
+                       (unsigned) sizes[s], (unsigned) chunks[c]);
+                return 1;
+            }
+            printf("%6u %6u %14.3f %14.3f %7.1fx\n",
+                   (unsigned) sizes[s], (unsigned) chunks[c], bw, bk, bk / bw);
+        }
+    }
+    return 0;
+}
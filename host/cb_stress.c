@@ -0,0 +1,958 @@
+/*
+    cb_stress.c - host stress and fuzz harness for the circular buffer library
+
+    Builds drivers/circbuff.c natively and runs producer and consumer threads
+    against one ring at full speed. Every byte carries a value derived from
+    its stream position, so the consumer can check ordering and count lost
+    or corrupted bytes. Each side picks a random access path per operation
+    (single byte, bulk copy or zero-copy span) with a random length.
+
+    Usage: cb_stress [spsc|mpsc|overwrite|fuzz|bip|mq|typed|stats|all]
+                     [bytes]
+
+        spsc       one producer, one consumer, 1 KB ring
+        mpsc       four CircularBufferMP producers, one consumer
+        overwrite  overwrite-mode producer; read + dropped must add up
+        fuzz       spsc over random power-of-2 sizes from 1 B to 4 KB
+        bip        BipBuffer grant/commit/peek/release, 1000 B storage
+        mq         MsgQueue of random-length messages, 256 B ring
+        typed      CB_TYPED_DECLARE ring of 12-byte records, 16 deep
+        stats      CB_STATS counters against a single-threaded model
+        all        each of the above (default)
+
+    bytes is the total pushed per run (default 64M, suffixes k/M/G). Ops/s
+    counts calls made by both sides. Ring storage is exactly the ring's size
+    and ends at an unmapped page, so an overrun faults instead of passing
+    silently. Build and run with `make stress`.
+
+    Built with -DCB_STATS (bin/cb_stress_stats, also run by `make stress`)
+    the spsc, fuzz and overwrite runs also check the ring's statistics, and
+    the stats mode is included in all.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "circbuff.h"
+#include "bipbuff.h"
+#include "msgqueue.h"
+
+#define MAX_CHUNK   (300)
+#define MP_PRODUCERS (4)
+
+// Value of the byte at stream position pos.
+#define STREAM_BYTE(pos) ((uint8_t)(((pos) * 2654435761u) >> 24))
+
+typedef struct {
+    uint64_t bytes;     // bytes to push
+    uint64_t ops;       // calls made
+    uint64_t lost;      // bytes missing or wrong on the consumer side
+    uint32_t seed;
+    uint64_t fills;     // producer calls that record fill (CB_STAT_FILL)
+} Side;
+
+static CircularBuffer cb;
+static CircularBufferMP mp;
+static volatile int producers_done;
+static volatile int consumer_quit;  // consumer gave up; stop producing
+
+static uint32_t xorshift(uint32_t* s)
+{
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Exactly size bytes of ring storage, ending right before an inaccessible
+// page, so any copy that runs past the end of the ring faults.
+static uint8_t* ring_storage(uint32_t size)
+{
+    static uint8_t* map;
+    static size_t map_len;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + page - 1) / page * page;
+
+    if (map){
+        munmap(map, map_len);
+    }
+    map_len = len + page;
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    mprotect(map + len, page, PROT_NONE);
+    return map + len - size;
+}
+
+
+/*  SPSC producer: push side->bytes of the stream, choosing cb_putc,
+    cb_write or cb_reserve_contiguous/cb_commit_write at random.
+*/
+static void* spsc_producer(void* arg)
+{
+    Side* side = arg;
+    uint8_t chunk[MAX_CHUNK];
+    uint64_t pos = 0;
+
+    while (pos < side->bytes){
+        uint32_t r = xorshift(&side->seed);
+        uint32_t want = 1 + (r >> 8) % MAX_CHUNK;
+        uint32_t n = 0;
+        uint8_t* p;
+
+        if (want > side->bytes - pos){
+            want = side->bytes - pos;
+        }
+        switch (r & 3){
+            case 0:
+                n = (cb_putc(&cb, STREAM_BYTE(pos)) == 0);
+                side->fills += n;
+                break;
+            case 1:
+                n = cb_reserve_contiguous(&cb, &p);
+                if (n > want){
+                    n = want;
+                }
+                for (uint32_t i = 0; i < n; i++){
+                    p[i] = STREAM_BYTE(pos + i);
+                }
+                cb_commit_write(&cb, n);
+                side->fills++;
+                break;
+            default:
+                for (uint32_t i = 0; i < want; i++){
+                    chunk[i] = STREAM_BYTE(pos + i);
+                }
+                n = cb_write(&cb, chunk, want);
+                side->fills++;
+                break;
+        }
+        side->ops++;
+        pos += n;
+        if (n == 0){
+            sched_yield();
+        }
+    }
+    producers_done = 1;
+    return NULL;
+}
+
+
+// SPSC consumer: drain side->bytes, checking each byte against the stream.
+static void spsc_consumer(Side* side)
+{
+    uint8_t chunk[MAX_CHUNK];
+    uint64_t pos = 0;
+
+    while (pos < side->bytes){
+        uint32_t r = xorshift(&side->seed);
+        uint32_t want = 1 + (r >> 8) % MAX_CHUNK;
+        uint32_t n = 0;
+        uint8_t* p = chunk;
+
+        switch (r & 3){
+            case 0:
+                if (!cb_isempty(&cb)){
+                    chunk[0] = cb_getc(&cb);
+                    n = 1;
+                }
+                break;
+            case 1:
+                n = cb_peek_contiguous(&cb, &p);
+                if (n > want){
+                    n = want;
+                }
+                break;
+            default:
+                n = cb_read(&cb, chunk, want);
+                break;
+        }
+        for (uint32_t i = 0; i < n; i++){
+            if (p[i] != STREAM_BYTE(pos + i)){
+                side->lost++;
+            }
+        }
+        if ((r & 3) == 1){
+            cb_commit_read(&cb, n);
+        }
+        side->ops++;
+        pos += n;
+        if (n == 0){
+            sched_yield();
+        }
+    }
+}
+
+
+#ifdef CB_STATS
+// What can still be pinned down with the consumer running concurrently:
+// fill never seen above the ring size, and one histogram entry per fill.
+static int stats_check(const char* name, uint32_t size, uint64_t fills)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < CB_STATS_BINS; i++){
+        total += cb.stats.hist[i];
+    }
+    if (cb.stats.peak > size || total != fills){
+        printf("%s: stats peak %u of %u, %llu histogram entries for %llu"
+               " fills\n", name, (unsigned) cb.stats.peak, (unsigned) size,
+               (unsigned long long) total, (unsigned long long) fills);
+        return 1;
+    }
+    return 0;
+}
+#else
+#define stats_check(name, size, fills) (0)
+#endif
+
+
+static int report(const char* name, uint32_t size, uint64_t bytes,
+                  uint64_t ops, uint64_t lost, double elapsed)
+{
+    printf("%-9s ring %4u: %llu bytes, %llu ops, %.2f Mops/s, %.1f MB/s,"
+           " %llu lost\n", name, (unsigned) size,
+           (unsigned long long) bytes, (unsigned long long) ops,
+           ops / elapsed * 1e-6, bytes / elapsed * 1e-6,
+           (unsigned long long) lost);
+    return lost != 0;
+}
+
+
+static int run_spsc(const char* name, uint32_t size, uint64_t bytes,
+                    uint32_t seed)
+{
+    pthread_t th;
+    Side prod = {bytes, 0, 0, seed | 1};
+    Side cons = {bytes, 0, 0, (seed * 7) | 1};
+
+    cb_init(&cb, ring_storage(size), size);
+    producers_done = 0;
+
+    double start = now_s();
+    pthread_create(&th, NULL, spsc_producer, &prod);
+    spsc_consumer(&cons);
+    pthread_join(th, NULL);
+
+    int fail = stats_check(name, size, prod.fills);
+    return report(name, size, bytes, prod.ops + cons.ops, cons.lost,
+                  now_s() - start) | fail;
+}
+
+
+/*  MPSC: each producer sends 8-byte records {id, seq, check} with
+    cb_mp_write; the consumer checks per-producer sequence numbers.
+*/
+static void* mpsc_producer(void* arg)
+{
+    Side* side = arg;
+    uint8_t rec[8];
+    uint32_t records = side->bytes / sizeof(rec);
+
+    for (uint32_t seq = 0; seq < records; seq++){
+        uint32_t check = seq * 2654435761u;
+        rec[0] = (uint8_t) side->seed;
+        memcpy(&rec[1], &seq, 4);
+        memcpy(&rec[5], &check, 3);
+        while (cb_mp_write(&mp, rec, sizeof(rec))){
+            side->ops++;
+            sched_yield();
+        }
+        side->ops++;
+    }
+    return NULL;
+}
+
+
+static int run_mpsc(uint64_t bytes)
+{
+    pthread_t th[MP_PRODUCERS];
+    Side prod[MP_PRODUCERS];
+    uint32_t expect[MP_PRODUCERS] = {0};
+    uint64_t ops = 0, lost = 0;
+    uint8_t rec[8];
+
+    bytes -= bytes % (8 * MP_PRODUCERS);
+    cb_mp_init(&mp, ring_storage(1024), 1024);
+
+    double start = now_s();
+    for (int i = 0; i < MP_PRODUCERS; i++){
+        prod[i] = (Side){bytes / MP_PRODUCERS, 0, 0, i};
+        pthread_create(&th[i], NULL, mpsc_producer, &prod[i]);
+    }
+
+    for (uint64_t got = 0; got < bytes; got += sizeof(rec)){
+        while (cb_count(&mp.cb) < sizeof(rec)){
+            ops++;
+            sched_yield();
+        }
+        cb_read(&mp.cb, rec, sizeof(rec));
+        ops++;
+
+        uint32_t seq, check = 0;
+        memcpy(&seq, &rec[1], 4);
+        memcpy(&check, &rec[5], 3);
+        if (rec[0] >= MP_PRODUCERS || seq != expect[rec[0]]
+            || check != ((seq * 2654435761u) & 0xFFFFFF)){
+            lost += sizeof(rec);
+            if (rec[0] < MP_PRODUCERS){
+                expect[rec[0]] = seq + 1;
+            }
+            continue;
+        }
+        expect[rec[0]]++;
+    }
+
+    for (int i = 0; i < MP_PRODUCERS; i++){
+        pthread_join(th[i], NULL);
+        ops += prod[i].ops;
+    }
+    return report("mpsc", 1024, bytes, ops, lost, now_s() - start);
+}
+
+
+/*  Overwrite mode: the producer never waits, so bytes are expected to go
+    missing. Every byte must be either read or counted in cb_dropped, and
+    each chunk read must be a run of consecutive stream bytes. The stream is
+    a plain byte counter here so a run can be checked without knowing where
+    it started.
+*/
+static void* ow_producer(void* arg)
+{
+    Side* side = arg;
+    uint8_t chunk[MAX_CHUNK];
+    uint64_t pos = 0;
+
+    while (pos < side->bytes){
+        uint32_t n = 1 + (xorshift(&side->seed) >> 8) % 64;
+        if (n > side->bytes - pos){
+            n = side->bytes - pos;
+        }
+        for (uint32_t i = 0; i < n; i++){
+            chunk[i] = (uint8_t)(pos + i);
+        }
+        cb_write_overwrite(&cb, chunk, n);
+        side->ops++;
+        side->fills++;
+        pos += n;
+        if ((side->ops & 63) == 0){
+            sched_yield();
+        }
+    }
+    producers_done = 1;
+    return NULL;
+}
+
+
+static int run_overwrite(uint64_t bytes)
+{
+    pthread_t th;
+    Side prod = {bytes, 0, 0, 12345};
+    uint64_t ops = 0, got = 0, misordered = 0;
+    uint8_t chunk[MAX_CHUNK];
+
+    cb_init(&cb, ring_storage(256), 256);
+    producers_done = 0;
+
+    double start = now_s();
+    pthread_create(&th, NULL, ow_producer, &prod);
+    for (;;){
+        uint32_t n = cb_read_overwrite(&cb, chunk, sizeof(chunk));
+        ops++;
+        if (n == 0){
+            if (producers_done && cb_count(&cb) == 0){
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        // Bytes are dropped from the front, so a chunk may start anywhere
+        // ahead of the last one, but must be contiguous within itself.
+        for (uint32_t i = 1; i < n; i++){
+            if (chunk[i] != (uint8_t)(chunk[i - 1] + 1)){
+                misordered++;
+            }
+        }
+        got += n;
+    }
+    pthread_join(th, NULL);
+
+    uint64_t dropped = cb_dropped(&cb);
+    uint64_t lost = misordered + ((got + dropped == bytes) ? 0 : 1);
+    lost += stats_check("overwrite", 256, prod.fills);
+#ifdef CB_STATS
+    if (cb.stats.full_hits != (uint32_t) dropped){
+        printf("overwrite: full_hits %u, dropped %u\n",
+               (unsigned) cb.stats.full_hits, (unsigned) dropped);
+        lost++;
+    }
+#endif
+    printf("overwrite: read %llu + dropped %llu of %llu\n",
+           (unsigned long long) got, (unsigned long long) dropped,
+           (unsigned long long) bytes);
+    return report("overwrite", 256, bytes, ops + prod.ops, lost,
+                  now_s() - start);
+}
+
+
+static int run_fuzz(uint64_t bytes)
+{
+    uint32_t seed = (uint32_t) time(NULL) | 1;
+    int fail = 0;
+
+    printf("fuzz seed %u\n", (unsigned) seed);
+    for (int i = 0; i < 16; i++){
+        uint32_t size = 1u << (xorshift(&seed) % 13);
+        fail |= run_spsc("fuzz", size, bytes / 16, xorshift(&seed));
+    }
+    return fail;
+}
+
+
+/*  Bip buffer: the producer reserves a random length, fills the start of
+    it with the stream and commits a random part of it; the consumer
+    releases a random part of each block it peeks. Storage is not a power
+    of 2 and chunks are up to 30% of it, so reservations regularly skip the
+    end of storage and wrap early.
+*/
+#define BIP_SIZE (1000)
+
+static BipBuffer bb;
+static volatile uint64_t bip_wraps;
+
+static void* bip_producer(void* arg)
+{
+    Side* side = arg;
+    uint64_t pos = 0;
+
+    while (pos < side->bytes){
+        uint32_t r = xorshift(&side->seed);
+        uint32_t len = 1 + (r >> 8) % MAX_CHUNK;
+        uint8_t* p = bb_reserve(&bb, len);
+        side->ops++;
+        if (!p){
+            if (consumer_quit){
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        uint32_t used = (r & 1) ? len : (r >> 20) % (len + 1);
+        if (used > side->bytes - pos){
+            used = side->bytes - pos;
+        }
+        for (uint32_t i = 0; i < used; i++){
+            p[i] = STREAM_BYTE(pos + i);
+        }
+        if (p == bb.buf && bb.write != 0){
+            bip_wraps++;
+        }
+        bb_commit(&bb, used);
+        pos += used;
+    }
+    producers_done = 1;
+    return NULL;
+}
+
+
+static int run_bip(uint64_t bytes)
+{
+    pthread_t th;
+    Side prod = {bytes, 0, 0, 99};
+    Side cons = {bytes, 0, 0, 77};
+    uint64_t pos = 0;
+
+    bb_init(&bb, ring_storage(BIP_SIZE), BIP_SIZE);
+    bip_wraps = 0;
+    producers_done = 0;
+    consumer_quit = 0;
+
+    double start = now_s();
+    pthread_create(&th, NULL, bip_producer, &prod);
+    while (pos < bytes){
+        uint8_t* p;
+        uint32_t n = bb_peek(&bb, &p);
+        cons.ops++;
+        if (n == 0){
+            if (producers_done && bb_peek(&bb, &p) == 0){
+                // Producer finished, but some of its bytes never showed.
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        if (n > BIP_SIZE){
+            // Bad block length; nothing after this can be trusted.
+            break;
+        }
+
+        uint32_t used = 1 + (xorshift(&cons.seed) >> 8) % n;
+        if (used > bytes - pos){
+            used = bytes - pos;
+        }
+        for (uint32_t i = 0; i < used; i++){
+            if (p[i] != STREAM_BYTE(pos + i)){
+                cons.lost++;
+            }
+        }
+        bb_release(&bb, used);
+        pos += used;
+    }
+    cons.lost += bytes - pos;
+    consumer_quit = 1;
+    pthread_join(th, NULL);
+
+    printf("bip: %llu early wraps\n", (unsigned long long) bip_wraps);
+    return report("bip", BIP_SIZE, bytes, prod.ops + cons.ops,
+                  cons.lost + (bip_wraps == 0), now_s() - start);
+}
+
+
+/*  Message queue: message seq has a length and contents derived from seq,
+    up to most of the ring, so pushes regularly find no room. Now and then
+    the producer also offers a message that can never fit, which must be
+    refused without touching the queue. The consumer pops with a random
+    maxlen and checks the full length and the truncated contents.
+*/
+#define MQ_SIZE   (256)
+#define MQ_MAXMSG (200)
+
+static MsgQueue mq;
+
+static uint32_t msg_len(uint32_t seq)
+{
+    return ((seq * 2654435761u) >> 16) % (MQ_MAXMSG + 1);
+}
+
+static uint8_t msg_byte(uint32_t seq, uint32_t i)
+{
+    return (uint8_t)(seq * 7 + i * 13);
+}
+
+static void* mq_producer(void* arg)
+{
+    Side* side = arg;
+    static uint8_t big[MQ_SIZE];
+    uint8_t msg[MQ_MAXMSG];
+
+    for (uint32_t seq = 0; seq < side->bytes; seq++){
+        uint32_t len = msg_len(seq);
+        for (uint32_t i = 0; i < len; i++){
+            msg[i] = msg_byte(seq, i);
+        }
+        if ((seq & 15) == 0 && mq_push(&mq, big, sizeof(big)) == 0){
+            // Took a message bigger than the ring.
+            side->lost++;
+        }
+        while (mq_push(&mq, msg, len)){
+            side->ops++;
+            if (consumer_quit){
+                return NULL;
+            }
+            sched_yield();
+        }
+        side->ops++;
+    }
+    producers_done = 1;
+    return NULL;
+}
+
+
+static int run_mq(uint64_t bytes)
+{
+    pthread_t th;
+    uint32_t records = bytes / (MQ_MAXMSG / 2 + MQ_HDR_SIZE);
+    Side prod = {records, 0, 0, 0};
+    Side cons = {records, 0, 0, 4321};
+    uint8_t msg[MQ_MAXMSG];
+
+    mq_init(&mq, ring_storage(MQ_SIZE), MQ_SIZE);
+    producers_done = 0;
+    consumer_quit = 0;
+
+    double start = now_s();
+    pthread_create(&th, NULL, mq_producer, &prod);
+    for (uint32_t seq = 0; seq < records; seq++){
+        while (mq_count(&mq) == 0 && !producers_done){
+            cons.ops++;
+            sched_yield();
+        }
+        if (mq_count(&mq) == 0){
+            // Producer finished, but some of its messages never showed.
+            cons.lost += records - seq;
+            break;
+        }
+        uint16_t maxlen = xorshift(&cons.seed) % (MQ_MAXMSG + 1);
+        int len = mq_pop(&mq, msg, maxlen);
+        cons.ops++;
+
+        if (len != (int) msg_len(seq)){
+            // Framing lost; later lengths would be garbage too.
+            cons.lost += records - seq;
+            break;
+        }
+        for (int i = 0; i < len && i < maxlen; i++){
+            if (msg[i] != msg_byte(seq, i)){
+                cons.lost++;
+                break;
+            }
+        }
+    }
+    consumer_quit = 1;
+    pthread_join(th, NULL);
+
+    printf("mq: %u messages\n", (unsigned) records);
+    return report("mq", MQ_SIZE, bytes, prod.ops + cons.ops,
+                  prod.lost + cons.lost, now_s() - start);
+}
+
+
+/*  Typed ring of multi-word records, so a torn element shows up as a
+    mismatch between its fields. Both sides mix single and bulk calls, and
+    the consumer peeks before some gets.
+*/
+#define TR_SIZE  (16)
+#define TR_BULK  (11)
+
+typedef struct {
+    uint32_t seq;
+    uint32_t inv;
+    uint32_t check;
+} StressRec;
+
+CB_TYPED_DECLARE(RecRing, rr, StressRec)
+
+static RecRing rr;
+
+static StressRec make_rec(uint32_t seq)
+{
+    return (StressRec){seq, ~seq, seq * 2654435761u};
+}
+
+static void* tr_producer(void* arg)
+{
+    Side* side = arg;
+    StressRec recs[TR_BULK];
+    uint32_t seq = 0;
+
+    while (seq < side->bytes){
+        uint32_t r = xorshift(&side->seed);
+        uint32_t n;
+        if (r & 1){
+            n = (rr_put(&rr, make_rec(seq)) == 0);
+        } else {
+            uint32_t want = 1 + (r >> 8) % TR_BULK;
+            if (want > side->bytes - seq){
+                want = side->bytes - seq;
+            }
+            for (uint32_t i = 0; i < want; i++){
+                recs[i] = make_rec(seq + i);
+            }
+            n = rr_write(&rr, recs, want);
+        }
+        side->ops++;
+        seq += n;
+        if (n == 0){
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+
+static int run_typed(uint64_t bytes)
+{
+    pthread_t th;
+    uint32_t records = bytes / sizeof(StressRec);
+    Side prod = {records, 0, 0, 31337};
+    Side cons = {records, 0, 0, 2718};
+    StressRec recs[TR_BULK];
+    uint32_t seq = 0;
+
+    rr_init(&rr, (StressRec*) ring_storage(TR_SIZE * sizeof(StressRec)),
+            TR_SIZE);
+
+    double start = now_s();
+    pthread_create(&th, NULL, tr_producer, &prod);
+    while (seq < records){
+        uint32_t r = xorshift(&cons.seed);
+        uint32_t n = 0;
+        switch (r & 3){
+            case 0:
+                n = (rr_get(&rr, &recs[0]) == 0);
+                break;
+            case 1:
+                if (rr_peek(&rr, &recs[0]) == 0){
+                    StressRec again;
+                    rr_get(&rr, &again);
+                    if (memcmp(&again, &recs[0], sizeof(again))){
+                        cons.lost++;
+                    }
+                    n = 1;
+                }
+                break;
+            default:
+                n = rr_read(&rr, recs, 1 + (r >> 8) % TR_BULK);
+                break;
+        }
+        for (uint32_t i = 0; i < n; i++){
+            StressRec want = make_rec(seq + i);
+            if (memcmp(&recs[i], &want, sizeof(want))){
+                cons.lost++;
+            }
+        }
+        cons.ops++;
+        seq += n;
+        if (n == 0){
+            sched_yield();
+        }
+    }
+    pthread_join(th, NULL);
+
+    return report("typed", TR_SIZE, (uint64_t) records * sizeof(StressRec),
+                  prod.ops + cons.ops, cons.lost, now_s() - start);
+}
+
+
+/*  CB_STATS counters, checked against a model of the ring. Everything runs
+    in one thread, so each expected value is exact: peak, one histogram bin
+    per fill call, full and empty hits, and one threshold callback per
+    upward crossing. The second half of the run switches the ring to
+    overwrite mode, whose reader must be cb_read_overwrite, so that writes
+    to a full ring are covered too. Then cb_stats_reset must clear the
+    counters but keep the threshold armed.
+*/
+#ifdef CB_STATS
+#define ST_SIZE      (64)
+#define ST_THRESHOLD (40)
+#define ST_OPS       (1000000)
+
+static uint32_t st_fired;
+static uint32_t st_bad_fire;
+
+static void st_on_threshold(CircularBuffer* c, uint32_t fill)
+{
+    st_fired++;
+    if (c != &cb || fill < ST_THRESHOLD){
+        st_bad_fire++;
+    }
+}
+
+static int run_stats(void)
+{
+    uint32_t seed = 99;
+    uint8_t chunk[ST_SIZE + 8] = {0};
+    uint32_t hist[CB_STATS_BINS] = {0};
+    uint32_t peak = 0, full = 0, empty = 0, crossings = 0;
+    uint64_t fills = 0;
+    int fail = 0;
+
+    cb_init(&cb, ring_storage(ST_SIZE), ST_SIZE);
+    cb_set_threshold(&cb, ST_THRESHOLD, st_on_threshold);
+    st_fired = 0;
+    st_bad_fire = 0;
+
+    for (uint32_t op = 0; op < ST_OPS; op++){
+        uint32_t r = xorshift(&seed);
+        uint32_t len = 1 + (r >> 8) % (ST_SIZE + 8);
+        uint32_t before = cb_count(&cb);
+        uint32_t dropped = cb_dropped(&cb);
+        int filled = 1;
+        uint32_t n;
+        uint8_t* p;
+
+        // Second half: overwrite mode, cases 5 and 6.
+        uint32_t kind = (ST_OPS / 2 <= op) ? 5 + (r & 1) : r % 5;
+        switch (kind){
+            case 0:
+                if (cb_putc(&cb, 0)){
+                    full++;
+                    filled = 0;
+                }
+                break;
+            case 1:
+                full += (len > ST_SIZE - before);
+                cb_write(&cb, chunk, len);
+                break;
+            case 2:
+                n = cb_reserve_contiguous(&cb, &p);
+                cb_commit_write(&cb, (len < n) ? len : n);
+                break;
+            case 3:
+                empty += (before == 0);
+                (void) cb_getc(&cb);
+                filled = 0;
+                break;
+            case 4:
+                empty += (before == 0);
+                cb_read(&cb, chunk, len);
+                filled = 0;
+                break;
+            case 5:
+                // Mostly short writes, some longer than the ring.
+                cb_write_overwrite(&cb, chunk, (r & 6) ? len % 20 : len);
+                full += cb_dropped(&cb) - dropped;
+                break;
+            default:
+                cb_read_overwrite(&cb, chunk, len);
+                filled = 0;
+                break;
+        }
+
+        if (filled){
+            uint32_t after = cb_count(&cb);
+            uint32_t bin = after * CB_STATS_BINS / ST_SIZE;
+            hist[(bin < CB_STATS_BINS) ? bin : CB_STATS_BINS - 1]++;
+            if (after > peak){
+                peak = after;
+            }
+            if (before < ST_THRESHOLD && ST_THRESHOLD <= after){
+                crossings++;
+            }
+            fills++;
+        }
+    }
+
+    CbStats* st = &cb.stats;
+    if (st->peak != peak || memcmp(st->hist, hist, sizeof(hist))
+        || st->full_hits != full || st->empty_hits != empty){
+        printf("stats: peak %u/%u, full %u/%u, empty %u/%u, histogram %s\n",
+               (unsigned) st->peak, (unsigned) peak,
+               (unsigned) st->full_hits, (unsigned) full,
+               (unsigned) st->empty_hits, (unsigned) empty,
+               memcmp(st->hist, hist, sizeof(hist)) ? "differs" : "ok");
+        fail = 1;
+    }
+    fail |= stats_check("stats", ST_SIZE, fills);
+    if (st_fired != crossings || st_bad_fire){
+        printf("stats: threshold fired %u times (%u below it) for %u"
+               " crossings\n", (unsigned) st_fired, (unsigned) st_bad_fire,
+               (unsigned) crossings);
+        fail = 1;
+    }
+
+    // Reset keeps the threshold: drain, then one write across it.
+    cb_stats_reset(&cb);
+    uint32_t hits = st->full_hits + st->empty_hits + st->peak;
+    for (int i = 0; i < CB_STATS_BINS; i++){
+        hits += st->hist[i];
+    }
+    cb_read_overwrite(&cb, chunk, ST_SIZE);
+    st_fired = 0;
+    cb_write(&cb, chunk, ST_THRESHOLD);
+    if (hits || st_fired != 1){
+        printf("stats: after reset %u counts left, threshold fired %u\n",
+               (unsigned) hits, (unsigned) st_fired);
+        fail = 1;
+    }
+
+    printf("stats: %u ops, %llu fills, %u crossings, peak %u\n",
+           (unsigned) ST_OPS, (unsigned long long) fills,
+           (unsigned) crossings, (unsigned) peak);
+    return fail;
+}
+#endif
+
+
+static uint64_t parse_bytes(const char* s)
+{
+    char* end;
+    uint64_t n = strtoull(s, &end, 0);
+    switch (*end){
+        case 'G': n <<= 10; // fall through
+        case 'M': n <<= 10; // fall through
+        case 'k': n <<= 10;
+    }
+    return n;
+}
+
+
+int main(int argc, char** argv)
+{
+    static const char* const modes[] = {
+        "spsc", "mpsc", "overwrite", "fuzz", "bip", "mq", "typed", "stats",
+        "all",
+    };
+    const char* mode = (argc > 1) ? argv[1] : "all";
+    uint64_t bytes = (argc > 2) ? parse_bytes(argv[2]) : (64ull << 20);
+    int all = !strcmp(mode, "all");
+    int fail = 0;
+
+    unsigned m = 0;
+    while (m < sizeof(modes) / sizeof(modes[0]) && strcmp(mode, modes[m])){
+        m++;
+    }
+    if (m == sizeof(modes) / sizeof(modes[0])){
+        fprintf(stderr, "usage: cb_stress [spsc|mpsc|overwrite|fuzz|bip|mq"
+                        "|typed|stats|all] [bytes]\n");
+        return 2;
+    }
+
+    if (all || !strcmp(mode, "spsc")){
+        fail |= run_spsc("spsc", 1024, bytes, 1);
+    }
+    if (all || !strcmp(mode, "mpsc")){
+        fail |= run_mpsc(bytes);
+    }
+    if (all || !strcmp(mode, "overwrite")){
+        fail |= run_overwrite(bytes);
+    }
+    if (all || !strcmp(mode, "fuzz")){
+        fail |= run_fuzz(bytes);
+    }
+    if (all || !strcmp(mode, "bip")){
+        fail |= run_bip(bytes);
+    }
+    if (all || !strcmp(mode, "mq")){
+        fail |= run_mq(bytes);
+    }
+    if (all || !strcmp(mode, "typed")){
+        fail |= run_typed(bytes);
+    }
+#ifdef CB_STATS
+    if (all || !strcmp(mode, "stats")){
+        fail |= run_stats();
+    }
+#else
+    if (!strcmp(mode, "stats")){
+        printf("stats: build with -DCB_STATS (bin/cb_stress_stats)\n");
+        fail = 1;
+    }
+#endif
+
+    printf("%s\n", fail ? "FAIL" : "PASS");
+    return fail;
+}
@@ -0,0 +1,90 @@
+/*
+    binlog.h - deferred binary logging
+
+    BINLOG("adc ch %u = %d", ch, val) stores a small binary record instead of
+    formatting text: a header holding the format string's ID and argument
+    count, a DWT cycle timestamp, and the raw 32-bit arguments. The format
+    strings go in their own binlog_fmt section, which the linker script keeps
+    in the ELF but never loads into flash, and a string's offset in that
+    section is its ID. binlog_flush streams records out of a UART, and
+    host/binlog_decode renders them to text using the same ELF.
+
+    Records are queued on a CircularBufferMP, so ISRs at any priority and the
+    main loop can all log. Arguments are passed as 32-bit words, so only
+    integer and %c conversions make sense in the format; %s is not supported.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+
+// Size of the record ring, in bytes. Must be a power of 2.
+#ifndef BINLOG_BUF_SIZE
+#define BINLOG_BUF_SIZE (1024)
+#endif
+
+// Most arguments a single record can carry.
+#define BINLOG_MAX_ARGS (8)
+
+/*  Record layout, all little-endian 32-bit words:
+        word 0: BINLOG_MAGIC | nargs << 24 | id
+        word 1: timestamp (DWT cycle count)
+        word 2..: nargs arguments
+    The magic nibble lets the decoder find record boundaries again after
+    dropped bytes.
+*/
+#define BINLOG_MAGIC       (0xB0000000)
+#define BINLOG_MAGIC_MASK  (0xF0000000)
+#define BINLOG_NARGS_SHIFT (24)
+#define BINLOG_ID_MASK     (0x00FFFFFF)
+
+// Start of the format string section, from the linker.
+extern const char __start_binlog_fmt[];
+
+#define BINLOG_NARGS(...) \
+    (sizeof((uint32_t[]){0, ##__VA_ARGS__}) / sizeof(uint32_t) - 1)
+
+#define BINLOG(fmt, ...) do { \
+    static const char _binlog_fmt[] \
+        __attribute__((section("binlog_fmt"), used)) = fmt; \
+    _Static_assert(BINLOG_NARGS(__VA_ARGS__) <= BINLOG_MAX_ARGS, \
+                   "too many binlog arguments"); \
+    binlog_write(BINLOG_MAGIC \
+                 | (BINLOG_NARGS(__VA_ARGS__) << BINLOG_NARGS_SHIFT) \
+                 | (uint32_t)(_binlog_fmt - __start_binlog_fmt), \
+                 (const uint32_t[]){0, ##__VA_ARGS__} + 1); \
+} while (0)
+
+// Set up the record ring and the cycle counter. Records are sent on uart,
+// which must already be initialized.
+void binlog_init(uint32_t uart);
+
+// Queue a record. Use the BINLOG macro rather than calling this directly.
+void binlog_write(uint32_t hdr, const uint32_t* args);
+
+// Send queued records out of the UART without waiting. Call from the main
+// loop. Returns number of bytes handed to the UART.
+uint32_t binlog_flush(void);
+
+// Number of records lost because the ring was full.
+uint32_t binlog_dropped(void);
+
+#endif // BINLOG_H
@@ -0,0 +1,63 @@
+/*
+    bipbuff.h - bipartite circular buffer
+
+    Byte queue that hands out contiguous regions of arbitrary length, so a
+    record is never split across the end of storage. The producer reserves a
+    region, fills it in place and commits it; the consumer gets the largest
+    committed block as one pointer/length pair, suitable for a parser or a
+    single DMA transfer. When a reservation does not fit at the end, the
+    writer wraps to the start and the unused tail of storage is skipped.
+
+    Safe for one producer and one consumer without locking. Storage may be
+    any size.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BIP_BUFFER_H
+#define BIP_BUFFER_H
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t write;  // end of committed data
+    volatile uint32_t read;   // start of unread data
+    volatile uint32_t last;   // end of valid data after the writer wraps
+    uint32_t grant;           // start of the producer's open reservation
+    uint32_t size;
+    uint8_t* buf;
+} BipBuffer;
+
+void bb_init(BipBuffer* bb, uint8_t* buf, uint32_t size);
+
+// Reserve len contiguous bytes. Returns pointer to the region, or 0 if no
+// region that large is free or len is 0. Only one reservation may be open
+// at a time.
+uint8_t* bb_reserve(BipBuffer* bb, uint32_t len);
+
+// Publish the first used bytes of the open reservation (used <= len).
+void bb_commit(BipBuffer* bb, uint32_t used);
+
+// Point *ptr at the oldest committed block and return its length, or 0 if
+// there is no data.
+uint32_t bb_peek(BipBuffer* bb, uint8_t** ptr);
+
+// Release the first used bytes of the block from bb_peek.
+void bb_release(BipBuffer* bb, uint32_t used);
+
+#endif // BIP_BUFFER_H
@@ -2,7 +2,8 @@
     circbuff.h - circular buffer library
 
     Provides simple byte queue of arbitrary length. User supplies the storage
-    for the buffer, which must be sized as a power of 2.
+    for the buffer, which must be sized as a power of 2. All size bytes are
+    usable.
 
 
     This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
@@ -27,18 +28,316 @@
 
 #include <stdint.h>
 
+// Keep buffer data accesses on the right side of the index update that
+// publishes them. On the single-core M4 an ISR sees our stores in program
+// order, so only the compiler needs fencing; other hosts get a real fence.
+#if defined(__arm__)
+#define CB_BARRIER() __asm__ volatile ("" ::: "memory")
+#else
+#define CB_BARRIER() __atomic_thread_fence(__ATOMIC_ACQ_REL)
+#endif
+
+// Build with -DCB_STATS to keep fill statistics on every CircularBuffer.
+// Without it the struct and every hook below compile away.
+#ifndef CB_STATS_BINS
+#define CB_STATS_BINS (8)
+#endif
+
+struct CircularBuffer;
+
 typedef struct {
+    uint32_t peak;                  // highest fill level seen
+    uint32_t hist[CB_STATS_BINS];   // fill after each write, in size/BINS steps
+    uint32_t full_hits;             // writes refused or cut short (or
+                                    // bytes dropped, in overwrite mode)
+    uint32_t empty_hits;            // reads that found no data
+    uint32_t threshold;             // fill level that fires on_threshold
+    void (*on_threshold)(struct CircularBuffer* cb, uint32_t fill);
+} CbStats;
+
+// head and tail count bytes written/read since init and wrap naturally at
+// 2^32; only (index & mask) is used to address buf.
+// Each side also keeps a private copy of the other side's index and only
+// re-reads the shared one when its copy says the buffer is full/empty.
+typedef struct CircularBuffer {
     volatile uint32_t head;
     volatile uint32_t tail;
     uint32_t mask;
     volatile uint8_t* buf;
+    uint32_t tail_cache;    // producer's last view of tail
+    uint32_t head_cache;    // consumer's last view of head
+    volatile uint32_t dropped;  // bytes discarded by overwrite-mode writes
+#ifdef CB_STATS
+    CbStats stats;
+#endif
 } CircularBuffer;
 
+#ifdef CB_STATS
+// Called by the producer after adding n bytes; counts fill and fires the
+// threshold callback when fill crosses stats.threshold going up.
+void cb_stat_fill(CircularBuffer* cb, uint32_t n);
+#define CB_STAT_FILL(cb, n)   cb_stat_fill((cb), (n))
+#define CB_STAT_FULL(cb)      ((cb)->stats.full_hits++)
+#define CB_STAT_FULL_N(cb, n) ((cb)->stats.full_hits += (n))
+#define CB_STAT_EMPTY(cb)     ((cb)->stats.empty_hits++)
+
+// Clear counters, keeping the threshold and callback.
+void cb_stats_reset(CircularBuffer* cb);
+
+// Call fn from the producer's context whenever fill rises to level or more.
+// A level of 0 disables the callback.
+void cb_set_threshold(CircularBuffer* cb, uint32_t level,
+                      void (*fn)(CircularBuffer* cb, uint32_t fill));
+#else
+#define CB_STAT_FILL(cb, n)   ((void) 0)
+#define CB_STAT_FULL(cb)      ((void) 0)
+#define CB_STAT_FULL_N(cb, n) ((void) 0)
+#define CB_STAT_EMPTY(cb)     ((void) 0)
+#endif
+
+// True if n is a nonzero power of 2. Usable in constant expressions.
+#define CB_IS_POW2(n) ((n) != 0 && (((n) & ((n) - 1)) == 0))
+
+// Initializer for a ring over storage of size bytes. Equivalent to cb_init,
+// but done by the C startup code copying .data.
+#define CB_INITIALIZER(storage, size) \
+    { .head = 0, .tail = 0, .mask = (size) - 1, .buf = (storage) }
+
+// Define a ring named name with size bytes of storage, ready to use without
+// cb_init. size must be a compile-time power of 2. Use at file scope.
+// Also defines name##_MASK for the CB_PUTC/CB_GETC fast paths below.
+#define CB_DEFINE(name, size) \
+    _Static_assert(CB_IS_POW2(size), #name ": size must be a power of 2"); \
+    enum { name##_MASK = (size) - 1 }; \
+    static uint8_t name##_storage[size]; \
+    CircularBuffer name = CB_INITIALIZER(name##_storage, size)
+
+// As CB_DEFINE, but with storage aligned to its own size, so hardware that
+// wraps on address bits (DMA DMOD/SMOD) can fill or drain it directly.
+#define CB_DEFINE_ALIGNED(name, size) \
+    _Static_assert(CB_IS_POW2(size), #name ": size must be a power of 2"); \
+    enum { name##_MASK = (size) - 1 }; \
+    static uint8_t name##_storage[size] __attribute__((aligned(size))); \
+    CircularBuffer name = CB_INITIALIZER(name##_storage, size)
+
+// Put/get on a ring from CB_DEFINE with the mask folded to a constant.
+// Same semantics as cb_putc/cb_getc.
+#define CB_PUTC(name, c) cb_putc_masked(&(name), (c), name##_MASK)
+#define CB_GETC(name)    cb_getc_masked(&(name), name##_MASK)
+
 void cb_init(CircularBuffer* cb, uint8_t* buf, uint32_t size);
 int cb_putc(CircularBuffer* cb, uint8_t c);
 uint8_t cb_getc(CircularBuffer* cb);
+// cb_isfull is for the producer and cb_isempty for the consumer, since
+// each updates that side's cached index.
 int cb_isfull(CircularBuffer* cb);
 int cb_isempty(CircularBuffer* cb);
 uint32_t cb_space(CircularBuffer* cb);
+uint32_t cb_count(CircularBuffer* cb);
+
+// Copy up to len bytes in/out of the buffer, handling the wrap point.
+// Returns number of bytes actually copied.
+uint32_t cb_write(CircularBuffer* cb, const uint8_t* src, uint32_t len);
+uint32_t cb_read(CircularBuffer* cb, uint8_t* dst, uint32_t len);
+
+// Zero-copy access for DMA or in-place parsing. Each call returns the length
+// of the largest linear span at the read (peek) or write (reserve) position
+// and points *ptr at it. Commit no more than the returned length.
+uint32_t cb_peek_contiguous(CircularBuffer* cb, uint8_t** ptr);
+void cb_commit_read(CircularBuffer* cb, uint32_t n);
+uint32_t cb_reserve_contiguous(CircularBuffer* cb, uint8_t** ptr);
+void cb_commit_write(CircularBuffer* cb, uint32_t n);
+
+// Overwrite-oldest (flight recorder) mode. Writes never fail or wait: when
+// there is no room, the oldest bytes are discarded by moving tail forward,
+// and counted in dropped. Only the newest size bytes of a longer write are
+// kept. The consumer of such a ring must use cb_read_overwrite, which
+// detects and retries around data overwritten while it was being copied.
+void cb_putc_overwrite(CircularBuffer* cb, uint8_t c);
+void cb_write_overwrite(CircularBuffer* cb, const uint8_t* src, uint32_t len);
+uint32_t cb_read_overwrite(CircularBuffer* cb, uint8_t* dst, uint32_t len);
+
+// Total bytes discarded by overwrite-mode writes since init.
+uint32_t cb_dropped(CircularBuffer* cb);
+
+// Raw copy to/from storage at free-running index pos, handling the wrap.
+// head and tail are not touched; for layers that frame their own data.
+void cb_store(CircularBuffer* cb, uint32_t pos, const uint8_t* src,
+              uint32_t len);
+void cb_load(CircularBuffer* cb, uint32_t pos, uint8_t* dst, uint32_t len);
+
+
+// Multi-producer ring. Any number of producers (main loop and ISRs of any
+// priority) may call cb_mp_putc/cb_mp_write concurrently; slots are claimed
+// with LDREX/STREX, so interrupts are never masked. There must still be a
+// single consumer, which uses the normal cb_* read calls on &mp->cb.
+typedef struct {
+    CircularBuffer cb;
+    volatile uint32_t reserve;  // bytes claimed by producers
+    volatile uint32_t written;  // bytes copied in by producers
+} CircularBufferMP;
+
+void cb_mp_init(CircularBufferMP* mp, uint8_t* buf, uint32_t size);
+
+// Queue c, or all len bytes of src as one unit. Return -1 if full, else 0.
+int cb_mp_putc(CircularBufferMP* mp, uint8_t c);
+int cb_mp_write(CircularBufferMP* mp, const uint8_t* src, uint32_t len);
+
+// Inline put/get with a caller-supplied mask, for use through CB_PUTC and
+// CB_GETC. When mask is a constant, indexing compiles to an immediate AND.
+static inline int cb_putc_masked(CircularBuffer* cb, uint8_t c, uint32_t mask)
+{
+    uint32_t head = cb->head;
+    if (head - cb->tail_cache > mask){
+        cb->tail_cache = cb->tail;
+        if (head - cb->tail_cache > mask){
+            CB_STAT_FULL(cb);
+            return -1;
+        }
+    }
+    cb->buf[head & mask] = c;
+    cb->head = head + 1;
+    CB_STAT_FILL(cb, 1);
+    return 0;
+}
+
+static inline uint8_t cb_getc_masked(CircularBuffer* cb, uint32_t mask)
+{
+    uint32_t tail = cb->tail;
+    if (cb->head_cache == tail){
+        cb->head_cache = cb->head;
+        if (cb->head_cache == tail){
+            CB_STAT_EMPTY(cb);
+            return 0;
+        }
+    }
+    uint8_t c = cb->buf[tail & mask];
+    cb->tail = tail + 1;
+    return c;
+}
+
+
+
+/*  Typed rings
+
+    CB_TYPED_DECLARE(type, prefix, T) generates an SPSC ring of elements of
+    type T (uint16_t samples, uint32_t words, small structs...) with the same
+    free-running index scheme as CircularBuffer. Storage is a T array, so
+    elements keep their natural alignment and move with single loads/stores.
+    Sizes are in elements and must be a power of 2.
+
+    Generated API, all static inline:
+        void     prefix_init(type* r, T* buf, uint32_t size);
+        int      prefix_put(type* r, T v);          // -1 if full
+        int      prefix_get(type* r, T* v);         // -1 if empty
+        int      prefix_peek(type* r, T* v);        // get without removing
+        uint32_t prefix_write(type* r, const T* src, uint32_t n);
+        uint32_t prefix_read(type* r, T* dst, uint32_t n);
+        uint32_t prefix_count(type* r);
+        uint32_t prefix_space(type* r);
+
+    CB_TYPED_DEFINE(name, type, T, size) is the CB_DEFINE equivalent.
+*/
+#define CB_TYPED_DECLARE(type, prefix, T) \
+typedef struct { \
+    volatile uint32_t head; \
+    volatile uint32_t tail; \
+    uint32_t mask; \
+    T* buf; \
+} type; \
+\
+static inline void prefix##_init(type* r, T* buf, uint32_t size) \
+{ \
+    r->head = 0; \
+    r->tail = 0; \
+    r->mask = size - 1; \
+    r->buf = buf; \
+} \
+\
+static inline int prefix##_put(type* r, T v) \
+{ \
+    uint32_t head = r->head; \
+    if (head - r->tail > r->mask){ \
+        return -1; \
+    } \
+    r->buf[head & r->mask] = v; \
+    CB_BARRIER(); \
+    r->head = head + 1; \
+    return 0; \
+} \
+\
+static inline int prefix##_get(type* r, T* v) \
+{ \
+    uint32_t tail = r->tail; \
+    if (r->head == tail){ \
+        return -1; \
+    } \
+    CB_BARRIER(); \
+    *v = r->buf[tail & r->mask]; \
+    CB_BARRIER(); \
+    r->tail = tail + 1; \
+    return 0; \
+} \
+\
+static inline int prefix##_peek(type* r, T* v) \
+{ \
+    uint32_t tail = r->tail; \
+    if (r->head == tail){ \
+        return -1; \
+    } \
+    CB_BARRIER(); \
+    *v = r->buf[tail & r->mask]; \
+    return 0; \
+} \
+\
+static inline uint32_t prefix##_write(type* r, const T* src, uint32_t n) \
+{ \
+    uint32_t head = r->head; \
+    uint32_t space = (r->mask + 1) - (head - r->tail); \
+    if (n > space){ \
+        n = space; \
+    } \
+    for (uint32_t i = 0; i < n; i++){ \
+        r->buf[(head + i) & r->mask] = src[i]; \
+    } \
+    CB_BARRIER(); \
+    r->head = head + n; \
+    return n; \
+} \
+\
+static inline uint32_t prefix##_read(type* r, T* dst, uint32_t n) \
+{ \
+    uint32_t tail = r->tail; \
+    uint32_t avail = r->head - tail; \
+    if (n > avail){ \
+        n = avail; \
+    } \
+    CB_BARRIER(); \
+    for (uint32_t i = 0; i < n; i++){ \
+        dst[i] = r->buf[(tail + i) & r->mask]; \
+    } \
+    CB_BARRIER(); \
+    r->tail = tail + n; \
+    return n; \
+} \
+\
+static inline uint32_t prefix##_count(type* r) \
+{ \
+    return r->head - r->tail; \
+} \
+\
+static inline uint32_t prefix##_space(type* r) \
+{ \
+    return (r->mask + 1) - (r->head - r->tail); \
+}
+
+#define CB_TYPED_DEFINE(name, type, T, size) \
+    _Static_assert(CB_IS_POW2(size), #name ": size must be a power of 2"); \
+    static T name##_storage[size]; \
+    type name = CB_INITIALIZER(name##_storage, size)
+
+// Rings of 16-bit samples (e.g. adc_readone results) and 32-bit words.
+CB_TYPED_DECLARE(CircularBuffer16, cb16, uint16_t)
+CB_TYPED_DECLARE(CircularBuffer32, cb32, uint32_t)
 
 #endif
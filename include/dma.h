@@ -19,7 +19,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #ifndef DMA_H_FILE
-#define DMA_HFILE
+#define DMA_H_FILE
 
 #include <stdint.h>
 
@@ -49,13 +49,47 @@ void dma_init(void);
 // Set DMA mux channel to a specific source.
 void dma_set_mux(uint32_t ch, uint32_t source);
 
+// Disconnect DMA mux channel from its source.
+void dma_clear_mux(uint32_t ch);
+
 // Configure DMA channel with TCD info.
 void dma_configure(uint32_t ch, DMA_TCD* tcd);
 
 // Enable DMA channel.
 void dma_enable(uint32_t ch);
 
+// Disable DMA channel.
+void dma_disable(uint32_t ch);
+
 // Enable DMA interrupt on channel (BYO isr).
 void dma_enable_int(uint32_t ch);
 
+// Set NVIC priority of the channel interrupt (0 is highest, in steps of 16).
+// Pick it relative to any ISR that shares state with the channel's handler,
+// so one can't preempt the other mid-update.
+void dma_set_int_priority(uint32_t ch, uint8_t priority);
+
+// Also interrupt at the halfway point of the major loop.
+void dma_enable_halfint(uint32_t ch);
+
+// Disable DMA interrupt on channel.
+void dma_disable_int(uint32_t ch);
+
+// Acknowledge channel interrupt. Call from the channel isr.
+void dma_clear_int(uint32_t ch);
+
+// Clear channel request enable when the major loop completes, so each
+// transfer runs once and waits to be re-armed with dma_enable.
+void dma_set_oneshot(uint32_t ch);
+
+// Point a configured channel at a new source and major loop count, without
+// touching the rest of its TCD. Channel must be idle.
+void dma_set_source(uint32_t ch, volatile void* source, uint16_t citer);
+
+// Major loop iterations left on channel.
+uint16_t dma_remaining(uint32_t ch);
+
+// Address the channel will write next.
+volatile void* dma_dest(uint32_t ch);
+
 #endif // DMA_H_FILE
@@ -0,0 +1,56 @@
+/*
+    msgqueue.h - queue of whole messages on circular buffer storage
+
+    Each message is stored as a 16-bit length followed by its bytes. A push
+    either queues the whole message or nothing, and a pop always takes one
+    whole message, so ISRs and the main loop can pass framed data without
+    re-framing a byte stream. Safe for one producer and one consumer.
+
+
+    This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
+    Copyright 2017 Patrick Schubert
+
+    Cedar BSP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Cedar BSP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MSG_QUEUE_H
+#define MSG_QUEUE_H
+
+#include <stdint.h>
+#include "circbuff.h"
+
+// Bytes of overhead per queued message.
+#define MQ_HDR_SIZE (2)
+
+typedef struct {
+    CircularBuffer cb;
+    volatile uint32_t pushed;  // messages published by the producer
+    volatile uint32_t popped;  // messages taken by the consumer
+} MsgQueue;
+
+// Storage must be sized as a power of 2.
+void mq_init(MsgQueue* mq, uint8_t* buf, uint32_t size);
+
+// Queue len bytes from msg as one message. Returns -1 if it does not fit.
+int mq_push(MsgQueue* mq, const void* msg, uint16_t len);
+
+// Take the oldest message, copying at most maxlen bytes into msg; the rest
+// of a longer message is discarded. Returns the message's full length, or
+// -1 if the queue is empty.
+int mq_pop(MsgQueue* mq, void* msg, uint16_t maxlen);
+
+// Number of messages waiting.
+uint32_t mq_count(MsgQueue* mq);
+
+#endif // MSG_QUEUE_H
@@ -1,14 +1,17 @@
 /*
-    uart.h - support for uart0 peripheral on mk20/teensy
+    uart.h - support for uart0-2 peripherals on mk20/teensy
 
-    Interface to UART0 on teensy3, using teensy pins 0 and 1. ISR driven, with
-    ring buffer backing TX and RX.
+    Interface to UART0, UART1 and UART2 on teensy3. ISR driven, with ring
+    buffers backing TX and RX on each instance. Every call takes the instance
+    (UART0, UART1 or UART2) as its first argument.
+
+        UART0: RX teensy pin 0, TX pin 1. Clocked from F_CPU, 8 byte FIFO.
+        UART1: RX teensy pin 9, TX pin 10. Clocked from F_CPU, 8 byte FIFO.
+        UART2: RX teensy pin 7, TX pin 8. Clocked from F_BUS, no FIFO.
 
     Some sections written with help from Teensyduino/PJRC serial1.c code, as
     noted.
 
-    TODO: Support multiple uart channels
-
 
     This file is part of Cedar BSP, a bsp library for Teensy3.2 and similar.
     Copyright 2017 Patrick Schubert
@@ -31,6 +34,13 @@
 #define UART_H
 
 #include <stdint.h>
+#include <stdarg.h>
+
+// UART instances
+#define UART0 (0)
+#define UART1 (1)
+#define UART2 (2)
+#define UART_NUM_INSTANCES (3)
 
 // UART PARITY MODES
 #define UART_EVEN_PARITY (2)
@@ -41,25 +51,148 @@
 #define UART_ERROR_PARITY  (1<<0)
 #define UART_ERROR_FRAMING (1<<1)
 #define UART_ERROR_RXOVER  (1<<2)
-
-void uart_init(uint32_t baud);
+#define UART_ERROR_NOISE   (1<<3)
+#define UART_ERROR_OVERRUN (1<<4)   // hardware FIFO overrun
+#define UART_ERROR_BAUD    (1<<5)   // uart_init rate outside tolerance
+
+// Largest baud rate error accepted by uart_set_baud, in parts per million
+// (10000 = 1%). Both ends' errors add up, so keep well under the ~4% an
+// 8N1 frame can absorb.
+#ifndef UART_BAUD_TOLERANCE_PPM
+#define UART_BAUD_TOLERANCE_PPM (15000)
+#endif
+
+// uart_calc_baud/uart_set_baud results
+#define UART_BAUD_OK       (0)
+#define UART_BAUD_INEXACT  (-1)     // reachable, but error over tolerance
+#define UART_BAUD_INVALID  (-2)     // out of range for this UART's clock
+
+// Baud rate generator settings for a requested rate.
+typedef struct {
+    uint32_t clock;             // module clock (F_CPU for UART0/1, F_BUS for 2)
+    uint16_t sbr;               // integer divisor
+    uint8_t brfa;               // fractional divisor, in 1/32
+    uint32_t actual;            // rate those give
+    int32_t error_ppm;          // (actual - requested) / requested, in ppm
+    uint32_t max_byte_rate;     // bytes/s at actual, for the current framing
+} UartBaud;
+
+// Per-instance counters, see uart_get_stats. Times are DWT cycles.
+typedef struct {
+    uint32_t rx_bytes;          // bytes into the RX buffer
+    uint32_t tx_bytes;          // bytes handed to the transmitter
+    uint32_t rx_dropped;        // bytes lost to a full RX buffer
+    uint32_t tx_full;           // writes that didn't fit in the TX buffer
+    uint32_t isr_count;         // status ISR entries
+    uint32_t isr_cycles;        // total time in the status ISR
+    uint32_t isr_cycles_max;    // longest single status ISR
+    uint32_t tx_stall_cycles;   // time uart_write_wait slept on a full buffer
+    uint8_t rx_fifo_peak;       // most bytes seen waiting in the RX FIFO
+    uint16_t rx_buf_peak;       // highest RX buffer fill
+    uint32_t parity;            // receive error counts
+    uint32_t framing;
+    uint32_t overrun;
+    uint32_t noise;
+} UartStats;
+
+void uart_init(uint32_t uart, uint32_t baud);
 
 // Transmit single byte. Returns 0 on success.
-int uart_putc(uint8_t c);
+int uart_putc(uint32_t uart, uint8_t c);
 
 // Transmit null-terminated string. Returns 0 on success.
-int uart_puts(uint8_t* s);
-
-// Transmit null-terminated string, blocking until entire string loaded.
-int uart_puts_wait(uint8_t* s);
+int uart_puts(uint32_t uart, uint8_t* s);
+
+// Transmit null-terminated string, sleeping until entire string loaded.
+int uart_puts_wait(uint32_t uart, uint8_t* s);
+
+// Transmit len bytes, which may include zeros. Queues as much as fits in the
+// TX buffer. Returns number of bytes queued.
+uint32_t uart_write(uint32_t uart, const uint8_t* buf, uint32_t len);
+
+// As uart_write, but sleeps (WFI) while the TX buffer is full until all len
+// bytes are queued or timeout_ms passes. timeout_ms of 0 waits forever.
+// Returns number of bytes queued.
+uint32_t uart_write_wait(uint32_t uart, const uint8_t* buf, uint32_t len,
+                         uint32_t timeout_ms);
+
+// Formatted output straight into the TX buffer, without heap or newlib.
+// Supports %d %i %u %x %X %c %s %p %% with the flags '-' '0' '+' ' ' '#',
+// width and precision (either may be '*'), as in C. 64-bit, floating point
+// and %o/%n conversions aren't supported; their argument is skipped and the
+// spec printed as is. Never waits; once the buffer fills, the rest of the
+// output is dropped. Returns number of characters queued. Safe from ISR
+// context as long as that ISR is the only writer to this UART's TX buffer.
+int uart_printf(uint32_t uart, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int uart_vprintf(uint32_t uart, const char* fmt, va_list ap);
+
+// Print v as fixed point with decimals digits (up to 9) after the point, so
+// v = -12345 with 3 decimals prints "-12.345". Same rules as uart_printf.
+int uart_putfixed(uint32_t uart, int32_t v, uint32_t decimals);
+
+// Enable RTS/CTS flow control. rts_pin is any TEENSY_PIN_x, driven from RX
+// buffer fill; on a hardware RTS pin (UART0: 6 or 19, UART1: 22, UART2: 2)
+// the UART also deasserts it at the RX FIFO watermark. cts_pin must be a
+// hardware CTS pin of this UART (UART0: 18 or 20, UART1: 23, UART2: 14).
+// 0 disables that side. Returns 0 on success.
+int uart_set_flowctrl(uint32_t uart, uint32_t rts_pin, uint32_t cts_pin);
+
+// Work out divisors and error for baud on this UART, without touching the
+// hardware. Rates from clock / (16 * 8192) up to clock / 16. Returns
+// UART_BAUD_OK, UART_BAUD_INEXACT or UART_BAUD_INVALID.
+int uart_calc_baud(uint32_t uart, uint32_t baud, UartBaud* out);
+
+// Change the baud rate of a running UART. Only applied when the result is
+// UART_BAUD_OK. *out (may be 0) gets the uart_calc_baud result.
+int uart_set_baud(uint32_t uart, uint32_t baud, UartBaud* out);
 
 // Set parity mode of UART.
-void uart_setparity(uint8_t type);
+void uart_setparity(uint32_t uart, uint8_t type);
 
 // Pull a character out of the RX buffer. Returns 0 on success.
-int uart_getc(uint8_t* c);
+int uart_getc(uint32_t uart, uint8_t* c);
+
+// Pull up to len bytes out of the RX buffer. Returns number of bytes read.
+uint32_t uart_read(uint32_t uart, uint8_t* buf, uint32_t len);
+
+// As uart_read, but stops at the end of one RX chunk and stores the DWT
+// cycle count at which the UART ISR saw that chunk in *ts (0 if unknown).
+// Chunks are whatever one RX/idle interrupt delivered, so with the FIFO
+// watermark at 4 the first byte may be up to 4 character times older.
+// Returns number of bytes read.
+uint32_t uart_read_frame(uint32_t uart, uint8_t* buf, uint32_t len,
+                         uint32_t* ts);
+
+// As uart_read, but sleeps (WFI) while the RX buffer is empty until len
+// bytes arrive or timeout_ms passes. timeout_ms of 0 waits forever.
+// Returns number of bytes read.
+uint32_t uart_read_wait(uint32_t uart, uint8_t* buf, uint32_t len,
+                        uint32_t timeout_ms);
 
 // Returns a bitfield of UART errors experienced since last geterror call.
-uint32_t uart_geterror(void);
+uint32_t uart_geterror(uint32_t uart);
+
+// Drive TX from DMA channel ch instead of the status ISR. Requires dma_init.
+// Returns 0 on success.
+int uart_tx_dma_enable(uint32_t uart, uint32_t ch);
+
+// TX DMA completion handler. Call from the dma_chN_isr of the TX channel.
+void uart_tx_dma_isr(uint32_t uart);
+
+// Receive into the RX ring with DMA channel ch instead of the status ISR.
+// Requires dma_init. Returns 0 on success.
+int uart_rx_dma_enable(uint32_t uart, uint32_t ch);
+
+// RX DMA handler, runs every few bytes. Call from the dma_chN_isr of the RX
+// channel.
+void uart_rx_dma_isr(uint32_t uart);
+
+// Copy instance counters into *out. Counters are only kept when the driver
+// is built with UART_STATS; otherwise *out is zeroed and this returns -1.
+int uart_get_stats(uint32_t uart, UartStats* out);
+
+// Zero instance counters.
+void uart_reset_stats(uint32_t uart);
 
 #endif // UART_H